@@ -8,6 +8,10 @@ bool __comparePointsY(Vector3 theFirst, Vector3 theSecond) {
 	return theFirst.y < theSecond.y;
 }
 
+bool __comparePointsZ(Vector3 theFirst, Vector3 theSecond) {
+	return theFirst.z < theSecond.z;
+}
+
 CharackCoastGenerator::CharackCoastGenerator() {
 	mMaxDivision	= 4;
 	mMaxVariation	= 10;
@@ -63,6 +67,9 @@ std::list<Vector3> CharackCoastGenerator::generate(Vector3 thePointA, Vector3 th
 
 		} else if(thePerturbationAxis == CharackCoastGenerator::AXIS_Y) {
 			aMidPoint.y = aMidPoint.y - _CK_CG_RRAND(-aSettings.x, aSettings.x);
+
+		} else if(thePerturbationAxis == CharackCoastGenerator::AXIS_Z) {
+			aMidPoint.z = aMidPoint.z - _CK_CG_RRAND(-aSettings.x, aSettings.x);
 		}
 
 		aSettings.x = aSettings.x/2;
@@ -84,9 +91,10 @@ std::list<Vector3> CharackCoastGenerator::generate(Vector3 thePointA, Vector3 th
 	aResult.push_back(thePointB);
 	
 	if(thePerturbationAxis == CharackCoastGenerator::AXIS_X) {
-		aResult.sort(__comparePointsY);
+		// The line goes along Y or, on the ground (X,Z), along Z.
+		aResult.sort(thePointA.y != thePointB.y ? __comparePointsY : __comparePointsZ);
 
-	} else if(thePerturbationAxis == CharackCoastGenerator::AXIS_Y) {
+	} else if(thePerturbationAxis == CharackCoastGenerator::AXIS_Y || thePerturbationAxis == CharackCoastGenerator::AXIS_Z) {
 		aResult.sort(__comparePointsX);
 	}
 
@@ -33,8 +33,8 @@
 
 #include "CharackMapGenerator.h"
 
-// TODO: fix these global vars
-CTable colors =
+// Default palettes. Every CharackMapGenerator works on its own copy of them, since setcolours() changes the colours.
+static const CTable defaultColors =
 		{{0,0,255},	    /* Dark blue depths		*/
 		 {0,128,255},   /* Light blue shores	*/
 		 {0,255,0},	    /* Light green lowlands	*/
@@ -46,7 +46,7 @@ CTable colors =
 		 {0,0,0},	    /* Black - background	*/
 		 {0,0,0}};	    /* Black - gridlines	*/
 
-CTable alt_colors =
+static const CTable defaultAltColors =
 		{{0,0,192},	    /* Dark blue depths		*/
 		 {0,128,255},   /* Light blue shores	*/
 		 {0,96,0},	    /* Dark green Lowlands	*/
@@ -64,7 +64,16 @@ CharackMapGenerator::CharackMapGenerator() {
 	mCoastGen.setVariation(CK_COAST_VARIATION);
 
 	// For now, we have no idea of what is land and what is water...
+	mCoastMap = NULL;
+	mCoastMapSize = mCoastMapWords = 0;
+	mCoastMapX = mCoastMapZ = 0;
+	mCoastMapSample = 1;
 	clearCoastMap();
+	mCoastCells = NULL;
+	mCoastCellsSize = 0;
+
+	memcpy(colors, defaultColors, sizeof(CTable));
+	memcpy(alt_colors, defaultAltColors, sizeof(CTable));
 
 	altColors = 0;
 	back = BACK;
@@ -87,19 +96,148 @@ CharackMapGenerator::CharackMapGenerator() {
 
 	increment = 0.00000001;
 	best = 500000;
+
+	setThreads(CK_MAP_THREADS);
+	setNodeCache(CK_NODE_CACHE_STEP, CK_NODE_CACHE_WAYS);
+	setCoherent(CK_MAP_COHERENT);
+	setLandMaskOnly(CK_MAP_LAND_MASK_ONLY);
+	mLandMask = NULL;
+	mAltitude = NULL;
+	mCoastDistance = NULL;
+	mCoastDistanceReady = 0;
+	mContinentId = NULL;
+	mContinents = NULL;
+	mContinentCount = mContinentCapacity = 0;
+	mContinentsReady = 0;
+	mCoastIndexReady = 0;
+	mCacheView = NULL;
+	setKeepAltitude(CK_MAP_KEEP_ALTITUDE);
+	setOutline(CK_MAP_OUTLINE);
+	mSeaLevel = mNextSeaLevel = 0.0;
+	mCacheHit = 0;
+	mExporting = 0;
+	setCacheDir(CK_MAP_CACHE_DIR);
+	setLazy(CK_MAP_LAZY);
+	setMaskLayout(CK_MAP_MASK_LAYOUT);
+
+	col = NULL;
+	mPyramid = NULL;
+	mMapMemory = NULL;
+	mMapWidth = mMapHeight = 0;
+	mTiles = NULL;
+	mTilesX = mTilesY = 0;
+	mTilesGenerated = 0;
+#ifdef _WIN32
+	InitializeCriticalSection(&mBuildLock);
+#else
+	pthread_mutexattr_t aAttr;
+	pthread_mutexattr_init(&aAttr);
+	pthread_mutexattr_settype(&aAttr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&mBuildLock, &aAttr);
+	pthread_mutexattr_destroy(&aAttr);
+#endif
+
+	mEdgeTables = NULL;
+	mEdgeTableCount = 0;
+	setEdgeTable(CK_EDGE_TABLE_BITS);
 }
 
 CharackMapGenerator::~CharackMapGenerator() {
+	waitExport();
+	freeEdgeTables();
+	freeMap();
+	free(mContinents);
+	free(mCoastCells);
+	free(mCoastMap);
+	free(mTiles);
+#ifdef _WIN32
+	DeleteCriticalSection(&mBuildLock);
+#else
+	pthread_mutex_destroy(&mBuildLock);
+#endif
 }
 
+void CharackMapGenerator::allocMap(void) {
+	int j;
 
-void CharackMapGenerator::generate() {
-  int i;
+	// The map is only allocated again if its size has changed.
+	if(mMapMemory != NULL && mMapWidth == Width && mMapHeight == Height && (mAltitude != NULL) == (mKeepAltitude != 0)) {
+		return;
+	}
+	freeMap();
+
+	// One block for the whole map, aligned to CK_MAP_ALIGN bytes, with the rows padded to a multiple of CK_MAP_ALIGN.
+	mMapStride	= (Width + CK_MAP_ALIGN - 1) / CK_MAP_ALIGN * CK_MAP_ALIGN;
+	mMapMemory	= (unsigned char*)calloc(mMapStride * Height + CK_MAP_ALIGN, sizeof(unsigned char));
+	col			= (unsigned char**)malloc(Height * sizeof(unsigned char*));
+
+	// The land mask has one bit per pixel, 64 pixels per word.
+	allocLandMask();
+
+	sizePyramid();
+	mPyramid = (unsigned char*)malloc(mPyramidOffset[mPyramidLevels + 1]);
+
+	// The altitude of each pixel, row by row, if it is kept.
+	mAltitude = mKeepAltitude ? (float*)malloc(Width * Height * sizeof(float)) : NULL;
+
+	if(mMapMemory == NULL || col == NULL || mLandMask == NULL || mPyramid == NULL || (mKeepAltitude && mAltitude == NULL)) {
+		fprintf(stderr, "Memory allocation failed.");
+		exit(1);
+	}
+
+	mMap = (unsigned char*)(((size_t)mMapMemory + CK_MAP_ALIGN - 1) & ~(size_t)(CK_MAP_ALIGN - 1));
+	for(j = 0; j < Height; j++) {
+		col[j] = mMap + j * mMapStride;
+	}
+
+	mMapWidth	= Width;
+	mMapHeight	= Height;
+}
+
+void CharackMapGenerator::sizePyramid(void) {
+	// The pyramid has the levels 1, 2, ... until a level with just one cell (level 0 is the land mask).
+	mPyramidWidth[0]	= Width;
+	mPyramidHeight[0]	= Height;
+	mPyramidOffset[0]	= 0;
+	mPyramidOffset[1]	= 0;
+	for(mPyramidLevels = 0; mPyramidWidth[mPyramidLevels] > 1 || mPyramidHeight[mPyramidLevels] > 1; mPyramidLevels++) {
+		mPyramidWidth[mPyramidLevels + 1]	= (mPyramidWidth[mPyramidLevels] + 1) / 2;
+		mPyramidHeight[mPyramidLevels + 1]	= (mPyramidHeight[mPyramidLevels] + 1) / 2;
+		mPyramidOffset[mPyramidLevels + 2]	= mPyramidOffset[mPyramidLevels + 1] + mPyramidWidth[mPyramidLevels + 1] * mPyramidHeight[mPyramidLevels + 1];
+	}
+}
+
+void CharackMapGenerator::freeMap(void) {
+	// A map read from the cache file belongs to the file, only the row pointers were allocated.
+	if(mCacheView != NULL) {
+		unmapFile(mCacheView, mCacheSize);
+		mCacheView = NULL;
+	} else {
+		free(mMapMemory);
+		free(mLandMask);
+		free(mPyramid);
+		free(mAltitude);
+	}
+	free(col);
+	free(mCoastDistance);
+	free(mContinentId);
+
+	mMapMemory	= NULL;
+	mMap		= NULL;
+	col			= NULL;
+	mLandMask	= NULL;
+	mPyramid	= NULL;
+	mAltitude	= NULL;
+	mCoastDistance = NULL;
+	mCoastDistanceReady = 0;
+	mContinentId = NULL;
+	mContinentsReady = 0;
+	mCoastIndexReady = 0;
+	mMapWidth	= mMapHeight = 0;
+}
 
-  FILE *outfile, *colfile = NULL;
-  char filename[256] = "C:\\temp\\p.bmp";
-  int do_file = 0;
 
+void CharackMapGenerator::generate() {
   longi = 0.0;
   lat = 0.0;
   scale = 1.0;
@@ -107,13 +245,6 @@ void CharackMapGenerator::generate() {
   
   vgrid = hgrid = 0.0;
 
-	outfile = fopen(filename,"wb");
-
-	if (outfile == NULL) {
-		fprintf(stderr, "Could not open output file %s, error code = %d\n", filename, errno);
-		exit(0);
-	}
-  
   if (longi>180) longi -= 360;
   longi = longi*DEG2RAD;
   lat = lat*DEG2RAD;
@@ -121,25 +252,11 @@ void CharackMapGenerator::generate() {
   sla = sin(lat); cla = cos(lat);
   slo = sin(longi); clo = cos(longi);
 
-// TODO: fix this malloc. It must be done just once, not every method call...
-
-	col = (unsigned char**)calloc(Width,sizeof(unsigned char*));
-	if (col == 0) {
-	  fprintf(stderr, "Memory allocation failed.");
-	  exit(1);
-	}
-	for (i=0; i<Width; i++) {
-	  col[i] = (unsigned char*)calloc(Height,sizeof(unsigned char));
-	  if (col[i] == 0) {
-	fprintf(stderr, 
-		"Memory allocation failed at %d out of %d cols\n", 
-		i+1,Width);
-	exit(1);
-	  }
-	}
-  
   setcolours();
 
+  /* a sea level set without the altitudes kept waits for this generate() */
+  mSeaLevel = mNextSeaLevel;
+
   Depth = 3*((int)(log_2(scale*Height)))+6;
 
   r1 = rseed;
@@ -149,10 +266,39 @@ void CharackMapGenerator::generate() {
   r3 = rand2(r1,r2);
   r4 = rand2(r2,r3);
 
+  // In the lazy mode nothing is generated now: globalIsLand() generates each tile of the map
+  // the first time it is used.
+  free(mTiles);
+  mTiles = NULL;
+  mCoastDistanceReady = 0;
+  mContinentsReady = 0;
+  mCoastIndexReady = 0;
+
+  // A map generated before with the same parameters is read from the cache.
+  mCacheHit = mCacheDir[0] != '\0' && loadCache();
+  if (mCacheHit) {
+    return;
+  }
+
+  allocMap();
+  memset(mPyramid, CK_PYRAMID_UNKNOWN, mPyramidOffset[mPyramidLevels + 1]);
+
+  if (mLazy) {
+    mercatorInit();
+    mTilesX = (Width + CK_MAP_TILE_SIZE - 1) / CK_MAP_TILE_SIZE;
+    mTilesY = (Height + CK_MAP_TILE_SIZE - 1) / CK_MAP_TILE_SIZE;
+    mTiles = (int*)calloc(mTilesX*mTilesY,sizeof(int));
+    mTilesGenerated = 0;
+    return;
+  }
+
   mercator();
-  makeoutline(1);
-	
-  printbmpBW(outfile);
+  outlineTile(mMap, mMapStride, 0, 0, Width, Height, 0, 0, Width, Height);
+  buildPyramid(0, 0, Width, Height);
+
+  if (mCacheDir[0] != '\0') {
+    saveCache();
+  }
 }
 
 void CharackMapGenerator::setcolours()
@@ -279,62 +425,694 @@ void CharackMapGenerator::setcolours()
 
 }
 
-void CharackMapGenerator::makeoutline(int do_bw)
+void CharackMapGenerator::mercatorInit()
+{
+  double y;
+
+  y = sin(lat);
+  y = (1.0+y)/(1.0-y);
+  y = 0.5*log(y);
+  mMapShift = (int)(0.5*y*Width*scale/PI);
+
+  mNodeCacheLookups = 0;
+  memset(mNodeCacheHits, 0, sizeof(mNodeCacheHits));
+  mDescentPoints = 0;
+  mDescentLevels = 0;
+  mDescentDepths = 0;
+
+  // The midpoints depend on rseed, dd1, dd2 and POW, so the edges of the last map are useless.
+  clearEdgeTables();
+
+  // The bound used by signdecided() is only valid if a new vertex can not go beyond the altitudes of
+  // the edge it splits (dd1 <= 0.5), and the land/water split is only the sign of the altitude
+  // with the default palette.
+  mSignOnly = mLandMaskOnly && dd1 <= 0.5 && !altColors && !latic && mAltitude == NULL && mSeaLevel == 0.0;
+}
+
+void CharackMapGenerator::mercator()
+{
+  int aBand, aBands;
+
+  mercatorInit();
+
+  // Every row of the map is independent of the others, so the rows are split into bands
+  // which are generated in parallel. Each band has its own CK_PLANET_CONTEXT, so the
+  // threads never share any state while they are working (the edge table belongs to the thread).
+  aBands = (Height + CK_MAP_BAND_ROWS - 1) / CK_MAP_BAND_ROWS;
+
+#ifdef _OPENMP
+  #pragma omp parallel for schedule(dynamic) num_threads(getThreads())
+#endif
+  for (aBand = 0; aBand < aBands; aBand++) {
+    int aFirstRow = aBand * CK_MAP_BAND_ROWS;
+    mercatorRows(aFirstRow, min_dov(aFirstRow + CK_MAP_BAND_ROWS, Height), 0, Width, mMapShift, NULL);
+  }
+}
+
+// Calculate the colours of the columns [theFirstCol,theLastCol) of the rows [theFirstRow,theLastRow).
+// They are written to col, or to theOut (row by row, starting at theFirstCol of theFirstRow) if it is not NULL.
+void CharackMapGenerator::mercatorRows(int theFirstRow, int theLastRow, int theFirstCol, int theLastCol, int theShift, unsigned char *theOut)
+{
+  double y,cos2,theta1;
+  double ax[CK_MAP_BATCH], ay[CK_MAP_BATCH], az[CK_MAP_BATCH], aAlt[CK_MAP_BATCH];
+  int i,j,k,n,aDepth,aWidth = theLastCol-theFirstCol;
+  CK_PLANET_CONTEXT aContext;
+
+  memset(&aContext, 0, sizeof(CK_PLANET_CONTEXT));
+  aContext.edges = edgeTable();
+
+  for (j = theFirstRow; j < theLastRow; j++) {
+    mercatorRow(j,theShift,&y,&cos2,&aDepth);
+    for (i = theFirstCol; i < theLastCol; i += CK_MAP_BATCH) {
+      n = min_dov(CK_MAP_BATCH, theLastCol-i);
+      for (k = 0; k < n; k++) {
+	theta1 = longi-0.5*PI+PI*(2.0*(i+k)-Width)/Width/scale;
+	ax[k] = cos(theta1)*cos2; ay[k] = y; az[k] = -sin(theta1)*cos2;
+      }
+      planetBatch(ax,ay,az,aAlt,n,aDepth,&aContext);
+      if (mAltitude != NULL)
+	for (k = 0; k < n; k++) mAltitude[j*Width+i+k] = (float)aAlt[k];
+      if (theOut != NULL)
+	for (k = 0; k < n; k++) theOut[(j-theFirstRow)*aWidth+i+k-theFirstCol] = altcolour(aAlt[k]-mSeaLevel,y);
+      else
+	for (k = 0; k < n; k++) col[j][i+k] = altcolour(aAlt[k]-mSeaLevel,y);
+    }
+  }
+
+#ifdef _OPENMP
+  #pragma omp critical
+#endif
+  {
+    mNodeCacheLookups += aContext.nodes.lookups;
+    for (i = 0; i < CK_NODE_CACHE_MAX_DEPTHS; i++) mNodeCacheHits[i] += aContext.nodes.hits[i];
+    mDescentPoints += aContext.points;
+    mDescentLevels += aContext.levels;
+    mDescentDepths += aContext.depths;
+  }
+}
+
+void CharackMapGenerator::mercatorRow(int theRow, int theShift, double *y, double *cos2, int *theDepth)
+{
+  *y = PI*(2.0*(theRow-theShift)-Height)/Width/scale;
+  *y = exp(2.*(*y));
+  *y = (*y-1.)/(*y+1.);
+  *cos2 = sqrt(1.0-(*y)*(*y));
+  *theDepth = depthAt(*y);
+}
+
+// The depth of the subdivision for the points of the sphere at the height y, which is the depth mercator() uses for the row
+// at that latitude (the pixels get narrower on the sphere towards the poles).
+int CharackMapGenerator::depthAt(double y)
+{
+  return 3*((int)(log_2(scale*Width/Height/sqrt(1.0-y*y)/PI*Height)))+3;
+}
+
+// Generate the tile theTile of the lazy map: its colours are calculated with a border of one pixel,
+// which is what outlineTile() needs to find the outline of the tile, and then it is turned into
+// the same black and white map generate() makes. The tile is only marked as generated when it is
+// complete, so the queries that find it generated can read it without taking mBuildLock.
+void CharackMapGenerator::mercatorTile(int theTile)
+{
+  int aBand, aBands;
+  int x0, y0, x1, y1, ax0, ay0, ax1, ay1, aWidth;
+  unsigned char *aRaw;
+
+  x0 = (theTile % mTilesX) * CK_MAP_TILE_SIZE; x1 = min_dov(x0 + CK_MAP_TILE_SIZE, Width);
+  y0 = (theTile / mTilesX) * CK_MAP_TILE_SIZE; y1 = min_dov(y0 + CK_MAP_TILE_SIZE, Height);
+  ax0 = max_dov(x0 - 1, 0); ax1 = min_dov(x1 + 1, Width);
+  ay0 = max_dov(y0 - 1, 0); ay1 = min_dov(y1 + 1, Height);
+  aWidth = ax1 - ax0;
+
+  aRaw = (unsigned char*)malloc(aWidth*(ay1-ay0));
+  aBands = (ay1 - ay0 + CK_MAP_BAND_ROWS - 1) / CK_MAP_BAND_ROWS;
+
+#ifdef _OPENMP
+  #pragma omp parallel for schedule(dynamic) num_threads(getThreads())
+#endif
+  for (aBand = 0; aBand < aBands; aBand++) {
+    int aFirstRow = ay0 + aBand * CK_MAP_BAND_ROWS;
+    mercatorRows(aFirstRow, min_dov(aFirstRow + CK_MAP_BAND_ROWS, ay1), ax0, ax1, mMapShift, aRaw + (aFirstRow-ay0)*aWidth);
+  }
+
+  outlineTile(aRaw, aWidth, ax0, ay0, ax1, ay1, x0, y0, x1, y1);
+
+  free(aRaw);
+  buildPyramid(x0, y0, x1, y1);
+  mTilesGenerated++;
+  storeReady(&mTiles[theTile]);
+}
+
+// Write the black and white map of [x0,x1) x [y0,y1) to col and to the land mask, from the colours theRaw of the rectangle
+// [ax0,ax1) x [ay0,ay1) (theStride bytes per row), which must include the pixels around [x0,x1) x [y0,y1) that are inside
+// the map. Land and the water next to it are black, the rest of the water is white. theRaw can be the map itself.
+void CharackMapGenerator::outlineTile(const unsigned char *theRaw, int theStride, int ax0, int ay0, int ax1, int ay1, int x0, int y0, int x1, int y1)
+{
+  if (mOutline == CK_OUTLINE_BYTES) {
+    outlineBytes(theRaw,theStride,ax0,ay0,ax1,ay1,x0,y0,x1,y1);
+    packLandMask(x0, y0, x1, y1);
+  } else {
+    outlineBits(theRaw,theStride,ax0,ay0,ax1,ay1,x0,y0,x1,y1);
+  }
+}
+
+// Set the bits of theLand (pixels that are land) and theSolid (pixels that are not water) for the n colours of theRaw.
+void CharackMapGenerator::packColours(const unsigned char *theRaw, int n, unsigned long long *theLand, unsigned long long *theSolid)
+{
+  int i = 0;
+
+#ifdef CK_SSE2
+  {
+    __m128i aLand0 = _mm_set1_epi8((char)LAND0), aBlue0 = _mm_set1_epi8((char)BLUE0), aBlue1 = _mm_set1_epi8((char)BLUE1);
+    __m128i c, aWater;
+
+    /* the colours are unsigned, so c >= k is max(c,k) == c; 16 pixels never cross a word */
+    for (; i+16 <= n; i += 16) {
+      c = _mm_loadu_si128((const __m128i*)(theRaw+i));
+      aWater = _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(c,aBlue0),c), _mm_cmpeq_epi8(_mm_min_epu8(c,aBlue1),c));
+      theLand[i>>6] |= (unsigned long long)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(c,aLand0),c)) << (i&63);
+      theSolid[i>>6] |= (unsigned long long)(~_mm_movemask_epi8(aWater) & 0xFFFF) << (i&63);
+    }
+  }
+#endif
+
+  for (; i < n; i++) {
+    if (theRaw[i] >= LAND0) theLand[i>>6] |= 1ULL << (i&63);
+    if (theRaw[i] < BLUE0 || theRaw[i] > BLUE1) theSolid[i>>6] |= 1ULL << (i&63);
+  }
+}
+
+// The 64 bits of theRow starting at the bit theBit (theRow must have one word after them).
+unsigned long long CharackMapGenerator::wordAt(const unsigned long long *theRow, int theBit)
+{
+  int s = theBit & 63;
+
+  theRow += theBit >> 6;
+  return s ? (theRow[0] >> s) | (theRow[1] << (64-s)) : theRow[0];
+}
+
+// The outline as a dilation of the land: each row of land bits is dilated along the row by shifting its words one bit
+// each way, and the dilated rows j-1, j and j+1 are combined to get the water next to land in row j.
+void CharackMapGenerator::outlineBits(const unsigned char *theRaw, int theStride, int ax0, int ay0, int ax1, int ay1, int x0, int y0, int x1, int y1)
 {
-  int i,j,k;
+  unsigned long long *aLand, *aSolid, *aNear, *l, *h, *aMask, aBlack, aInside, m;
+  int i, j, k, n, w, s, aWords = (ax1-ax0+63)/64+1, aRows = ay1-ay0;
+
+  aLand = (unsigned long long*)calloc(3*aRows*aWords, sizeof(unsigned long long));
+  aSolid = aLand + aRows*aWords;
+  aNear = aSolid + aRows*aWords;
 
-  outx = (int*)calloc(Width*Height,sizeof(int));
-  outy = (int*)calloc(Width*Height,sizeof(int));
-  k=0;
-  for (i=1; i<Width-1; i++)
-    for (j=1; j<Height-1; j++)
-      if ((col[i][j] >= BLUE0 && col[i][j] <= BLUE1) &&
-	  (col[i-1][j] >= LAND0 || col[i+1][j] >= LAND0 ||
-	   col[i][j-1] >= LAND0 || col[i][j+1] >= LAND0 ||
-	   col[i-1][j-1] >= LAND0 || col[i-1][j+1] >= LAND0 ||
-	   col[i+1][j-1] >= LAND0 || col[i+1][j+1] >= LAND0)) {
-	outx[k] = i; outy[k++] =j;
+  for (k = 0; k < aRows; k++)
+    packColours(theRaw+k*theStride, ax1-ax0, aLand+k*aWords, aSolid+k*aWords);
+
+  for (k = 0; k < aRows; k++) {
+    l = aLand+k*aWords; h = aNear+k*aWords;
+    for (w = 0; w < aWords; w++)
+      h[w] = l[w] | (l[w]<<1) | (l[w]>>1) | (w > 0 ? l[w-1]>>63 : 0) | (w+1 < aWords ? l[w+1]<<63 : 0);
+  }
+
+  for (j = y0; j < y1; j++) {
+    k = j-ay0;
+    aMask = mMaskLayout == CK_MASK_ROWS ? mLandMask + j*mLandMaskStride : NULL;
+
+    for (i = x0; i < x1; i += 64) {
+      n = min_dov(64, x1-i);
+      aBlack = wordAt(aSolid+k*aWords, i-ax0);
+
+      /* only the pixels inside the border of the map get black if there is land around them */
+      if (j > 0 && j < Height-1) {
+	aInside = ~0ULL;
+	if (i == 0) aInside &= ~1ULL;
+	if (Width-1-i < 64) aInside &= ~(1ULL << (Width-1-i));
+	aBlack |= aInside & (wordAt(aNear+(k-1)*aWords, i-ax0) | wordAt(aNear+k*aWords, i-ax0) | wordAt(aNear+(k+1)*aWords, i-ax0));
       }
-  if (do_bw)
-    for (i=0; i<Width; i++)
-      for (j=0; j<Height; j++) {
-	if (col[i][j] >= BLUE0 && col[i][j] <= BLUE1)
-	  col[i][j] = WHITE;
-	else col[i][j] = BLACK;
+
+      m = n < 64 ? (1ULL << n) - 1 : ~0ULL;
+      aBlack &= m;
+
+      for (w = 0; w < n; w++) col[j][i+w] = (aBlack >> w) & 1 ? BLACK : WHITE;
+
+      /* the land mask is written right away when its rows are made of words */
+      if (aMask != NULL) {
+	s = i & 63;
+	aMask[i>>6] = (aMask[i>>6] & ~(m << s)) | (aBlack << s);
+	if (s && s+n > 64) aMask[(i>>6)+1] = (aMask[(i>>6)+1] & ~(m >> (64-s))) | (aBlack >> (64-s));
       }
-  while (k-->0) col[outx[k]][outy[k]] = BLACK;
+    }
+  }
+
+  free(aLand);
+
+  if (mMaskLayout != CK_MASK_ROWS) packLandMask(x0, y0, x1, y1);
 }
 
-void CharackMapGenerator::mercator()
+// The same outline with one byte per pixel (0 or 0xFF), 16 pixels at a time when SSE2 is available. The flags of a row
+// are found one row before it is written, so the rows of theRaw are read before they are changed.
+void CharackMapGenerator::outlineBytes(const unsigned char *theRaw, int theStride, int ax0, int ay0, int ax1, int ay1, int x0, int y0, int x1, int y1)
 {
-  double y,scale1,cos2,theta1;
-  int i,j,k;
+  const unsigned char *aRow;
+  unsigned char *aBuffer, *aLand[3], *aSolid[3], *aNear, c, b;
+  int i, j, k, r, t, aWidth = ax1-ax0, aPad = aWidth+32;
+
+  /* each row of flags has 16 empty bytes before and after it */
+  aBuffer = (unsigned char*)calloc(7*aPad, sizeof(unsigned char));
+  for (k = 0; k < 3; k++) {
+    aLand[k] = aBuffer + (2*k)*aPad + 16;
+    aSolid[k] = aBuffer + (2*k+1)*aPad + 16;
+  }
+  aNear = aBuffer + 6*aPad + 16;
+
+  for (r = ay0; r <= ay1; r++) {
+    /* the flags of row r */
+    if (r < ay1) {
+      aRow = theRaw + (r-ay0)*theStride;
+      for (t = 0; t < aWidth; t++) {
+	c = aRow[t];
+	aLand[(r-ay0)%3][t] = c >= LAND0 ? 0xFF : 0;
+	aSolid[(r-ay0)%3][t] = c < BLUE0 || c > BLUE1 ? 0xFF : 0;
+      }
+    }
 
-  y = sin(lat);
-  y = (1.0+y)/(1.0-y);
-  y = 0.5*log(y);
-  k = (int)(0.5*y*Width*scale/PI);
-  for (j = 0; j < Height; j++) {
-    y = PI*(2.0*(j-k)-Height)/Width/scale;
-    y = exp(2.*y);
-    y = (y-1.)/(y+1.);
-    scale1 = scale*Width/Height/sqrt(1.0-y*y)/PI;
-    cos2 = sqrt(1.0-y*y);
-    Depth = 3*((int)(log_2(scale1*Height)))+3;
-    for (i = 0; i < Width ; i++) {
-      theta1 = longi-0.5*PI+PI*(2.0*i-Width)/Width/scale;
-      col[i][j] = planet0(cos(theta1)*cos2,y,-sin(theta1)*cos2);
+    /* and row j = r-1 is written */
+    j = r-1;
+    if (j >= y0 && j < y1) {
+      k = j-ay0;
+      t = x0-ax0;
+
+      if (j > 0 && j < Height-1) {
+	for (i = 0; i < aWidth; i++) aNear[i] = aLand[(k+2)%3][i] | aLand[k%3][i] | aLand[(k+1)%3][i];
+      } else {
+	memset(aNear, 0, aWidth);
+      }
+
+      i = x0;
+#ifdef CK_SSE2
+      {
+	__m128i aBlackColour = _mm_set1_epi8((char)BLACK), aWhiteColour = _mm_set1_epi8((char)WHITE), aBlack;
+
+	for (; i+16 <= x1; i += 16, t += 16) {
+	  aBlack = _mm_or_si128(_mm_loadu_si128((__m128i*)(aNear+t-1)), _mm_loadu_si128((__m128i*)(aNear+t)));
+	  aBlack = _mm_or_si128(aBlack, _mm_loadu_si128((__m128i*)(aNear+t+1)));
+	  aBlack = _mm_or_si128(aBlack, _mm_loadu_si128((__m128i*)(aSolid[k%3]+t)));
+	  _mm_storeu_si128((__m128i*)(col[j]+i), _mm_or_si128(_mm_and_si128(aBlack,aBlackColour), _mm_andnot_si128(aBlack,aWhiteColour)));
+	}
+      }
+#endif
+      for (; i < x1; i++, t++) {
+	b = aSolid[k%3][t] | aNear[t-1] | aNear[t] | aNear[t+1];
+	col[j][i] = b ? BLACK : WHITE;
+      }
+
+      /* the first and last columns only get black if they are not water */
+      if (x0 == 0) col[j][0] = aSolid[k%3][-ax0] ? BLACK : WHITE;
+      if (x1 == Width) col[j][Width-1] = aSolid[k%3][Width-1-ax0] ? BLACK : WHITE;
+    }
+  }
+
+  free(aBuffer);
+}
+
+// Turn the altitudes of the columns [theFirstCol,theLastCol) of the row theRow into the colours mercatorRows()
+// would have calculated for them with the sea level at theLevel. With the default palette only land and water
+// matter (the map becomes black and white), so sixteen pixels are classified at once when SSE2 is available.
+void CharackMapGenerator::thresholdRow(int theRow, int theFirstCol, int theLastCol, double theLevel, unsigned char *theOut)
+{
+  const float *alt = mAltitude+theRow*Width;
+  double y, cos2;
+  int i = theFirstCol, aDepth;
+
+  if (altColors || latic) {
+    mercatorRow(theRow,mMapShift,&y,&cos2,&aDepth);
+    for (; i < theLastCol; i++) theOut[i-theFirstCol] = altcolour(alt[i]-theLevel,y);
+    return;
+  }
+
+#ifdef CK_SSE2
+  {
+    __m128 aLevel = _mm_set1_ps((float)theLevel);
+    __m128i aWater = _mm_set1_epi8((char)BLUE0), aLand = _mm_set1_epi8((char)(LAND0-BLUE0));
+    __m128i a0, a1, a2, a3;
+
+    /* the masks of the comparisons (0 or -1) are packed into bytes, which pick BLUE0 or LAND0 */
+    for (; i+16 <= theLastCol; i += 16) {
+      a0 = _mm_castps_si128(_mm_cmpgt_ps(_mm_loadu_ps(alt+i), aLevel));
+      a1 = _mm_castps_si128(_mm_cmpgt_ps(_mm_loadu_ps(alt+i+4), aLevel));
+      a2 = _mm_castps_si128(_mm_cmpgt_ps(_mm_loadu_ps(alt+i+8), aLevel));
+      a3 = _mm_castps_si128(_mm_cmpgt_ps(_mm_loadu_ps(alt+i+12), aLevel));
+      a0 = _mm_packs_epi16(_mm_packs_epi32(a0,a1), _mm_packs_epi32(a2,a3));
+      _mm_storeu_si128((__m128i*)(theOut+i-theFirstCol), _mm_add_epi8(aWater, _mm_and_si128(a0,aLand)));
     }
   }
+#endif
+
+  for (; i < theLastCol; i++) theOut[i-theFirstCol] = alt[i] > (float)theLevel ? LAND0 : BLUE0;
 }
 
+// Calculate the map of the rectangle [x0,x1) x [y0,y1) again from the kept altitudes, with the sea level at mSeaLevel.
+void CharackMapGenerator::rethreshold(int x0, int y0, int x1, int y1)
+{
+  int j, ax0, ay0, ax1, ay1, aWidth;
+  unsigned char *aRaw;
+
+  ax0 = max_dov(x0 - 1, 0); ax1 = min_dov(x1 + 1, Width);
+  ay0 = max_dov(y0 - 1, 0); ay1 = min_dov(y1 + 1, Height);
+  aWidth = ax1 - ax0;
 
-int CharackMapGenerator::planet0(double x, double y, double z)
+  aRaw = (unsigned char*)malloc(aWidth*(ay1-ay0));
+  for (j = ay0; j < ay1; j++) thresholdRow(j,ax0,ax1,mSeaLevel,aRaw+(j-ay0)*aWidth);
+
+  outlineTile(aRaw,aWidth,ax0,ay0,ax1,ay1,x0,y0,x1,y1);
+  free(aRaw);
+
+  buildPyramid(x0, y0, x1, y1);
+}
+
+// Squared distance transform of the n samples f (Felzenszwalb and Huttenlocher): d[q] is the minimum of (q-p)^2 + f[p]
+// over all p, found with the lower envelope of the parabolas rooted at each p. v and z must have n and n+1 entries.
+void CharackMapGenerator::distance1D(const double *f, int n, double *d, int *v, double *z)
 {
-  double alt;
-  int colour;
+  int k = 0, q;
+  double s;
+
+  v[0] = 0;
+  z[0] = -1e30; z[1] = 1e30;
+
+  for (q = 1; q < n; q++) {
+    s = ((f[q]+(double)q*q)-(f[v[k]]+(double)v[k]*v[k]))/(2.0*q-2.0*v[k]);
+    while (s <= z[k]) {
+      k--;
+      s = ((f[q]+(double)q*q)-(f[v[k]]+(double)v[k]*v[k]))/(2.0*q-2.0*v[k]);
+    }
+    k++;
+    v[k] = q;
+    z[k] = s; z[k+1] = 1e30;
+  }
+
+  for (k = 0, q = 0; q < n; q++) {
+    while (z[k+1] < q) k++;
+    d[q] = (double)(q-v[k])*(q-v[k])+f[v[k]];
+  }
+}
+
+// Squared distance (pixels) from every pixel of the map to the closest pixel whose land bit is theLand, written to theOut.
+// The distance along each column is found first, sweeping the rows down and up (so the map is read row by row), and then
+// the rows are transformed with distance1D() using the squares of those distances.
+void CharackMapGenerator::distanceTransform(int theLand, double *theOut)
+{
+  double aFar = Width+Height, *aAbove, *aRow;
+  int i, j;
+
+  for (i = 0; i < Width; i++) theOut[i] = (col[0][i] == BLACK) == theLand ? 0.0 : aFar;
+  for (j = 1; j < Height; j++) {
+    aRow = theOut+j*Width; aAbove = aRow-Width;
+    for (i = 0; i < Width; i++) aRow[i] = (col[j][i] == BLACK) == theLand ? 0.0 : aAbove[i]+1.0;
+  }
+  for (j = Height-2; j >= 0; j--) {
+    aRow = theOut+j*Width; aAbove = aRow+Width;
+    for (i = 0; i < Width; i++) if (aAbove[i]+1.0 < aRow[i]) aRow[i] = aAbove[i]+1.0;
+  }
+
+#ifdef _OPENMP
+  #pragma omp parallel num_threads(getThreads())
+#endif
+  {
+    double *f = (double*)malloc(Width*sizeof(double)), *z = (double*)malloc((Width+1)*sizeof(double));
+    int *v = (int*)malloc(Width*sizeof(int));
+    int k, t;
+
+#ifdef _OPENMP
+    #pragma omp for
+#endif
+    for (k = 0; k < Height; k++) {
+      for (t = 0; t < Width; t++) f[t] = theOut[k*Width+t]*theOut[k*Width+t];
+      distance1D(f,Width,theOut+k*Width,v,z);
+    }
+
+    free(f); free(z); free(v);
+  }
+}
+
+// Signed distance (pixels) from the center of every pixel to the coast, which lies half a pixel away from the last
+// land pixel: positive on land, negative on water.
+void CharackMapGenerator::buildCoastDistance(void)
+{
+  double *aToWater, *aToLand;
+  int i, j;
+
+  prepareTiles(0, 0, Width, Height);
+
+  if (mCoastDistance == NULL) mCoastDistance = (float*)malloc(Width*Height*sizeof(float));
+  aToWater = (double*)malloc(Width*Height*sizeof(double));
+  aToLand = (double*)malloc(Width*Height*sizeof(double));
+
+  distanceTransform(0,aToWater);
+  distanceTransform(1,aToLand);
+
+  for (j = 0; j < Height; j++)
+    for (i = 0; i < Width; i++)
+      mCoastDistance[j*Width+i] = col[j][i] == BLACK ? (float)(sqrt(aToWater[j*Width+i])-0.5) : (float)(0.5-sqrt(aToLand[j*Width+i]));
+
+  free(aToWater);
+  free(aToLand);
+  storeReady(&mCoastDistanceReady);
+}
+
+int CharackMapGenerator::findLabel(int *theParent, int theLabel)
+{
+  while (theParent[theLabel] != theLabel) {
+    theParent[theLabel] = theParent[theParent[theLabel]];
+    theLabel = theParent[theLabel];
+  }
+  return(theLabel);
+}
+
+void CharackMapGenerator::unionLabels(int *theParent, int a, int b)
+{
+  a = findLabel(theParent,a);
+  b = findLabel(theParent,b);
+  if (a < b) theParent[b] = a;
+  else if (b < a) theParent[a] = b;
+}
+
+// Label the land (black) pixels of the map that are connected (8 neighbours) with the same continent id, starting at 1.
+// The map is split in bands of CK_MAP_TILE_SIZE rows labelled in parallel, each with its own range of provisional labels,
+// so the threads never touch the same part of the union-find. The bands are then joined along their borders, and a last
+// pass gives each continent its id (in the order of their first pixel) and gathers its bounds, area and centroid.
+void CharackMapGenerator::labelContinents(void)
+{
+  int *aParent, *aIds, aBand, aBands, i, j, k, l;
+  CK_CONTINENT *c;
+
+  prepareTiles(0, 0, Width, Height);
+
+  if (mContinentId == NULL) mContinentId = (int*)malloc(Width*Height*sizeof(int));
+  aParent = (int*)malloc((Width*Height+1)*sizeof(int));
+  aIds = (int*)calloc(Width*Height+1,sizeof(int));
+  aBands = (Height + CK_MAP_TILE_SIZE - 1) / CK_MAP_TILE_SIZE;
+
+#ifdef _OPENMP
+  #pragma omp parallel for schedule(dynamic) num_threads(getThreads())
+#endif
+  for (aBand = 0; aBand < aBands; aBand++) {
+    int i, j, n, a, *p, y0 = aBand*CK_MAP_TILE_SIZE, y1 = min_dov(y0+CK_MAP_TILE_SIZE, Height);
+    int aNext = y0*Width+1; /* the labels of the band are y0*Width+1 .. y1*Width */
+
+    for (j = y0; j < y1; j++) {
+      p = mContinentId+j*Width;
+      for (i = 0; i < Width; i++) {
+	p[i] = 0;
+	if (col[j][i] != BLACK) continue;
+
+	/* the neighbours already visited: left, and the three above if they are in the band */
+	a = i > 0 ? p[i-1] : 0;
+	if (j > y0)
+	  for (n = max_dov(i-1,0); n <= min_dov(i+1,Width-1); n++)
+	    if (p[n-Width]) {
+	      if (a) unionLabels(aParent,a,p[n-Width]);
+	      else a = p[n-Width];
+	    }
+
+	if (!a) {
+	  a = aNext++;
+	  aParent[a] = a;
+	}
+	p[i] = a;
+      }
+    }
+  }
+
+  /* the bands are joined where the first row of a band touches the last row of the band above it */
+  for (aBand = 1; aBand < aBands; aBand++) {
+    j = aBand*CK_MAP_TILE_SIZE;
+    for (i = 0; i < Width; i++)
+      if (mContinentId[j*Width+i])
+	for (k = max_dov(i-1,0); k <= min_dov(i+1,Width-1); k++)
+	  if (mContinentId[(j-1)*Width+k]) unionLabels(aParent,mContinentId[j*Width+i],mContinentId[(j-1)*Width+k]);
+  }
+
+  /* the final ids and the table of continents */
+  mContinentCount = 0;
+  for (j = 0; j < Height; j++)
+    for (i = 0; i < Width; i++) {
+      l = mContinentId[j*Width+i];
+      if (!l) continue;
+
+      l = findLabel(aParent,l);
+      if (!aIds[l]) {
+	aIds[l] = ++mContinentCount;
+	if (mContinentCount > mContinentCapacity) {
+	  mContinentCapacity = 2*mContinentCapacity + 16;
+	  mContinents = (CK_CONTINENT*)realloc(mContinents, mContinentCapacity*sizeof(CK_CONTINENT));
+	}
+	c = mContinents + mContinentCount-1;
+	c->id = mContinentCount;
+	c->x0 = c->x1 = i;
+	c->y0 = c->y1 = j;
+	c->area = 0;
+	c->cx = c->cy = 0;
+	/* the first pixel, kept as -1-i until a pixel next to the water is found */
+	c->coastX = -1-i;
+	c->coastY = j;
+      }
+
+      c = mContinents + aIds[l]-1;
+      mContinentId[j*Width+i] = c->id;
+      if (c->coastX < 0 && ((i > 0 && col[j][i-1] != BLACK) || (i < Width-1 && col[j][i+1] != BLACK) ||
+			    (j > 0 && col[j-1][i] != BLACK) || (j < Height-1 && col[j+1][i] != BLACK))) {
+	c->coastX = i;
+	c->coastY = j;
+      }
+      if (i < c->x0) c->x0 = i;
+      if (i > c->x1) c->x1 = i;
+      c->y1 = j;
+      c->area++;
+      c->cx += i;
+      c->cy += j;
+    }
+
+  for (k = 0; k < mContinentCount; k++) {
+    mContinents[k].cx /= mContinents[k].area;
+    mContinents[k].cy /= mContinents[k].area;
+    /* no water around it: the continent covers the whole map */
+    if (mContinents[k].coastX < 0) mContinents[k].coastX = -1-mContinents[k].coastX;
+  }
+
+  free(aParent);
+  free(aIds);
+  storeReady(&mContinentsReady);
+}
+
+CK_EDGE_TABLE *CharackMapGenerator::edgeTable(void)
+{
+  int aThread = 0;
+
+  if (mEdgeTables == NULL) return NULL;
+#ifdef _OPENMP
+  aThread = omp_get_thread_num();
+#endif
+  return aThread < mEdgeTableCount ? &mEdgeTables[aThread] : NULL;
+}
+
+void CharackMapGenerator::clearEdgeTables(void)
+{
+  int i, j, aSize;
+
+  if (mEdgeTableBits <= 0) return;
+
+  // The tables are allocated once and reused by every map, unless the number of threads changes.
+  if (mEdgeTables != NULL && mEdgeTableCount != getThreads()) freeEdgeTables();
+  if (mEdgeTables == NULL) {
+    mEdgeTableCount = getThreads();
+    mEdgeTables = (CK_EDGE_TABLE*)calloc(mEdgeTableCount, sizeof(CK_EDGE_TABLE));
+    for (i = 0; i < mEdgeTableCount; i++) mEdgeTables[i].edges = (CK_EDGE*)malloc(sizeof(CK_EDGE) << mEdgeTableBits);
+  }
+
+  // Seeds are always inside (-1,1), so no edge matches an entry with s1 = 2.
+  aSize = 1 << mEdgeTableBits;
+  for (i = 0; i < mEdgeTableCount; i++) {
+    for (j = 0; j < aSize; j++) mEdgeTables[i].edges[j].s1 = 2.0;
+    mEdgeTables[i].lookups = 0;
+    mEdgeTables[i].hits = 0;
+  }
+}
+
+void CharackMapGenerator::freeEdgeTables(void)
+{
+  int i;
+
+  if (mEdgeTables != NULL) {
+    for (i = 0; i < mEdgeTableCount; i++) free(mEdgeTables[i].edges);
+    free(mEdgeTables);
+  }
+  mEdgeTables = NULL;
+  mEdgeTableCount = 0;
+}
+
+// Split the edge ab (lab is its squared length), returning its midpoint. The midpoint is taken from the edge
+// table of the context if it is there, otherwise it is calculated and stored in the table (or in theSpare
+// if there is no table).
+const CK_EDGE *CharackMapGenerator::edgemidpoint(const CK_VERTEX *a, const CK_VERTEX *b, double lab, CK_PLANET_CONTEXT *theContext, CK_EDGE *theSpare)
+{
+  CK_EDGE_TABLE *aTable = theContext->edges;
+  CK_EDGE *m = theSpare;
+  const CK_VERTEX *v1, *v2;
+  double aKey[4];
+  double es, es1, es2, es3, lp;
+  unsigned long long h1, h2, hx;
+
+  /* rand2() is symmetric and the split does not depend on the order of a and b */
+  if (a->seed < b->seed || (a->seed == b->seed && a->x < b->x)) {
+    v1 = a; v2 = b;
+  } else {
+    v1 = b; v2 = a;
+  }
+  aKey[0] = v1->seed; aKey[1] = v1->x; aKey[2] = v2->seed; aKey[3] = v2->x;
+
+  if (aTable != NULL) {
+    memcpy(&h1,&aKey[0],sizeof(h1));
+    memcpy(&h2,&aKey[2],sizeof(h2));
+    memcpy(&hx,&aKey[1],sizeof(hx));
+    h1 = (h1 ^ (hx>>7))*0x9E3779B97F4A7C15ULL;
+    memcpy(&hx,&aKey[3],sizeof(hx));
+    h2 = (h2 ^ (hx>>7))*0xC2B2AE3D27D4EB4FULL;
+    m = &aTable->edges[(unsigned int)((h1 ^ h2) >> (64-mEdgeTableBits))];
+    aTable->lookups++;
+    if (m->s1 == aKey[0] && m->x1 == aKey[1] && m->s2 == aKey[2] && m->x2 == aKey[3]) {
+      aTable->hits++;
+      return(m);
+    }
+  }
+
+  es = rand2(a->seed,b->seed);
+  es1 = rand2(es,es);
+  es2 = 0.5+0.1*rand2(es1,es1);
+  es3 = 1.0-es2;
+  if (a->x==b->x) { /* very unlikely to ever happen */
+    m->x = 0.5*a->x+0.5*b->x; m->y = 0.5*a->y+0.5*b->y; m->z = 0.5*a->z+0.5*b->z;
+  } else if (a->x<b->x) {
+    m->x = es2*a->x+es3*b->x; m->y = es2*a->y+es3*b->y; m->z = es2*a->z+es3*b->z;
+  } else {
+    m->x = es3*a->x+es2*b->x; m->y = es3*a->y+es2*b->y; m->z = es3*a->z+es2*b->z;
+  }
+  if (lab>1.0) lab = pow(lab,0.75);
+  lp = pow(lab,POW);
+  m->lp = lp;
+  m->alt = 0.5*(a->alt+b->alt)+es*dd1*fabs(a->alt-b->alt)+es1*dd2*lp;
+  m->seed = es;
+  m->s1 = aKey[0]; m->x1 = aKey[1];
+  m->s2 = aKey[2]; m->x2 = aKey[3];
+
+  return(m);
+}
+
 
-  alt = planet1(x,y,z);
+int CharackMapGenerator::planet0(double x, double y, double z, int theDepth, CK_PLANET_CONTEXT *theContext)
+{
+  return(altcolour(planet1(x,y,z,theDepth,theContext),y));
+}
+
+int CharackMapGenerator::altcolour(double alt, double y)
+{
+  int colour;
 
   if (altColors)
   {
@@ -401,117 +1179,130 @@ int CharackMapGenerator::planet0(double x, double y, double z)
   return(colour);
 }
 
-double ssa,ssb,ssc,ssd, ssas,ssbs,sscs,ssds,
-  ssax,ssay,ssaz, ssbx,ssby,ssbz, sscx,sscy,sscz, ssdx,ssdy,ssdz;
-
-// a,b,c,d;		    /* altitudes of the 4 verticess */
-// as,bs,cs,ds;	    /* seeds of the 4 verticess */
-// ax,ay,az, bx,by,bz,  /* vertex coordinates */
-// cx,cy,cz, dx,dy,dz;
+// theTetra;	    /* tetrahedron to start from (it is not changed) */
+// theTetraDepth;   /* depth of theTetra, counted from the root tetrahedron */
+// thePath;	    /* path from the root tetrahedron to theTetra */
 // x,y,z;		    /* goal point */
 // level;		    /* levels to go */
-
-double CharackMapGenerator::planet(double a,double b,double c,double d, double as, double bs, double cs, double ds, double ax, double ay, double az, double bx, double by, double bz, double cx, double cy, double cz, double dx, double dy, double dz, double x, double y, double z, int level)
+// theContext;	    /* where the nodes of the subdivision are remembered */
+//
+// The subdivision used to be a recursion with 24 arguments per call, which also called itself
+// just to reorder the vertices so the longest edge comes first. Here the tetrahedron is kept in
+// one CK_TETRAHEDRON and the vertices are reordered by swapping the pointers va..vd. When an edge
+// is split, the new vertex is written over the vertex that is left behind.
+
+double CharackMapGenerator::planet(const CK_TETRAHEDRON *theTetra, int theTetraDepth, unsigned int thePath, double x, double y, double z, int level, CK_PLANET_CONTEXT *theContext)
 {
+  CK_TETRAHEDRON t;
+  CK_VERTEX *va, *vb, *vc, *vd, *vt; /* the vertices of t acting as a, b, c and d */
   double abx,aby,abz, acx,acy,acz, adx,ady,adz;
   double bcx,bcy,bcz, bdx,bdy,bdz, cdx,cdy,cdz;
   double lab, lac, lad, lbc, lbd, lcd;
-  double ex, ey, ez, e, es, es1, es2, es3;
+  double ex, ey, ez;
   double eax,eay,eaz, epx,epy,epz;
   double ecx,ecy,ecz, edx,edy,edz;
+  double alt;
+  const CK_EDGE *m;
+  CK_EDGE aSpare;
+  int aDepth = theTetraDepth;
+  CK_PATH_STACK *aPath = &theContext->path;
 
-  if (level>0) {
-    if (level==11) {
-      ssa=a; ssb=b; ssc=c; ssd=d; ssas=as; ssbs=bs; sscs=cs; ssds=ds;
-      ssax=ax; ssay=ay; ssaz=az; ssbx=bx; ssby=by; ssbz=bz;
-      sscx=cx; sscy=cy; sscz=cz; ssdx=dx; ssdy=dy; ssdz=dz;
-    }
-    abx = ax-bx; aby = ay-by; abz = az-bz;
-    acx = ax-cx; acy = ay-cy; acz = az-cz;
+  t = *theTetra;
+  va = &t.v[0]; vb = &t.v[1]; vc = &t.v[2]; vd = &t.v[3];
+
+  while (level>0) {
+    abx = va->x-vb->x; aby = va->y-vb->y; abz = va->z-vb->z;
+    acx = va->x-vc->x; acy = va->y-vc->y; acz = va->z-vc->z;
     lab = abx*abx+aby*aby+abz*abz;
     lac = acx*acx+acy*acy+acz*acz;
 
-    if (lab<lac)
-      return(planet(a,c,b,d, as,cs,bs,ds,
-		    ax,ay,az, cx,cy,cz, bx,by,bz, dx,dy,dz,
-		    x,y,z, level));
-    else {
-      adx = ax-dx; ady = ay-dy; adz = az-dz;
-      lad = adx*adx+ady*ady+adz*adz;
-      if (lab<lad)
-	return(planet(a,d,b,c, as,ds,bs,cs,
-		      ax,ay,az, dx,dy,dz, bx,by,bz, cx,cy,cz,
-		      x,y,z, level));
-      else {
-	bcx = bx-cx; bcy = by-cy; bcz = bz-cz;
-	lbc = bcx*bcx+bcy*bcy+bcz*bcz;
-	if (lab<lbc)
-	  return(planet(b,c,a,d, bs,cs,as,ds,
-			bx,by,bz, cx,cy,cz, ax,ay,az, dx,dy,dz,
-			x,y,z, level));
-	else {
-	  bdx = bx-dx; bdy = by-dy; bdz = bz-dz;
-	  lbd = bdx*bdx+bdy*bdy+bdz*bdz;
-	  if (lab<lbd)
-	    return(planet(b,d,a,c, bs,ds,as,cs,
-			  bx,by,bz, dx,dy,dz, ax,ay,az, cx,cy,cz,
-			  x,y,z, level));
-	  else {
-	    cdx = cx-dx; cdy = cy-dy; cdz = cz-dz;
-	    lcd = cdx*cdx+cdy*cdy+cdz*cdz;
-	    if (lab<lcd)
-	      return(planet(c,d,a,b, cs,ds,as,bs,
-			    cx,cy,cz, dx,dy,dz, ax,ay,az, bx,by,bz,
-			    x,y,z, level));
-	    else {
-	      es = rand2(as,bs);
-	      es1 = rand2(es,es);
-	      es2 = 0.5+0.1*rand2(es1,es1);
-	      es3 = 1.0-es2;
-	      if (ax==bx) { /* very unlikely to ever happen */
-		ex = 0.5*ax+0.5*bx; ey = 0.5*ay+0.5*by; ez = 0.5*az+0.5*bz;
-	      } else if (ax<bx) {
-		ex = es2*ax+es3*bx; ey = es2*ay+es3*by; ez = es2*az+es3*bz;
-	      } else {
-		ex = es3*ax+es2*bx; ey = es3*ay+es2*by; ez = es3*az+es2*bz;
-	      }
-	      if (lab>1.0) lab = pow(lab,0.75);
-	      e = 0.5*(a+b)+es*dd1*fabs(a-b)+es1*dd2*pow(lab,POW);
-	      eax = ax-ex; eay = ay-ey; eaz = az-ez;
-	      epx =  x-ex; epy =  y-ey; epz =  z-ez;
-	      ecx = cx-ex; ecy = cy-ey; ecz = cz-ez;
-	      edx = dx-ex; edy = dy-ey; edz = dz-ez;
-	      if ((eax*ecy*edz+eay*ecz*edx+eaz*ecx*edy
-		   -eaz*ecy*edx-eay*ecx*edz-eax*ecz*edy)*
-		  (epx*ecy*edz+epy*ecz*edx+epz*ecx*edy
-		   -epz*ecy*edx-epy*ecx*edz-epx*ecz*edy)>0.0)
-		return(planet(c,d,a,e, cs,ds,as,es,
-			      cx,cy,cz, dx,dy,dz, ax,ay,az, ex,ey,ez,
-			      x,y,z, level-1));
-	      else
-		return(planet(c,d,b,e, cs,ds,bs,es,
-			      cx,cy,cz, dx,dy,dz, bx,by,bz, ex,ey,ez,
-			      x,y,z, level-1));
-	    }
-	  }
-	}
+    /* reorder the vertices until ab is the longest edge */
+    if (lab<lac) {
+      vt = vb; vb = vc; vc = vt;                          /* a,c,b,d */
+      continue;
+    }
+    adx = va->x-vd->x; ady = va->y-vd->y; adz = va->z-vd->z;
+    lad = adx*adx+ady*ady+adz*adz;
+    if (lab<lad) {
+      vt = vb; vb = vd; vd = vc; vc = vt;                 /* a,d,b,c */
+      continue;
+    }
+    bcx = vb->x-vc->x; bcy = vb->y-vc->y; bcz = vb->z-vc->z;
+    lbc = bcx*bcx+bcy*bcy+bcz*bcz;
+    if (lab<lbc) {
+      vt = va; va = vb; vb = vc; vc = vt;                 /* b,c,a,d */
+      continue;
+    }
+    bdx = vb->x-vd->x; bdy = vb->y-vd->y; bdz = vb->z-vd->z;
+    lbd = bdx*bdx+bdy*bdy+bdz*bdz;
+    if (lab<lbd) {
+      vt = va; va = vb; vb = vd; vd = vc; vc = vt;        /* b,d,a,c */
+      continue;
+    }
+    cdx = vc->x-vd->x; cdy = vc->y-vd->y; cdz = vc->z-vd->z;
+    lcd = cdx*cdx+cdy*cdy+cdz*cdz;
+    if (lab<lcd) {
+      vt = va; va = vc; vc = vt; vt = vb; vb = vd; vd = vt; /* c,d,a,b */
+      continue;
+    }
+
+    if (mCoherent) {
+      if (aDepth < CK_PATH_MAX_DEPTH) {
+        aPath->tetra[aDepth].v[0] = *va; aPath->tetra[aDepth].v[1] = *vb;
+        aPath->tetra[aDepth].v[2] = *vc; aPath->tetra[aDepth].v[3] = *vd;
+        aPath->size = aDepth+1;
       }
-    } 
-  }
-  else {
-    return((a+b+c+d)/4);
+    } else if (aDepth > theTetraDepth && aDepth <= mNodeCacheStep*mNodeCacheDepths && aDepth % mNodeCacheStep == 0) {
+      cacheNode(&theContext->nodes, aDepth/mNodeCacheStep - 1, va, vb, vc, vd, thePath);
+    }
+
+    /* split ab at e */
+    m = edgemidpoint(va,vb,lab,theContext,&aSpare);
+    if (mSignOnly && signdecided(va, vb, vc, vd, level, m->lp, &alt)) break;
+
+    ex = m->x; ey = m->y; ez = m->z;
+    eax = va->x-ex; eay = va->y-ey; eaz = va->z-ez;
+    epx =  x-ex; epy =  y-ey; epz =  z-ez;
+    ecx = vc->x-ex; ecy = vc->y-ey; ecz = vc->z-ez;
+    edx = vd->x-ex; edy = vd->y-ey; edz = vd->z-ez;
+    if ((eax*ecy*edz+eay*ecz*edx+eaz*ecx*edy
+	 -eaz*ecy*edx-eay*ecx*edz-eax*ecz*edy)*
+	(epx*ecy*edz+epy*ecz*edx+epz*ecx*edy
+	 -epz*ecy*edx-epy*ecx*edz-epx*ecz*edy)>0.0) {
+      /* continue with c,d,a,e: e is written over b */
+      vt = vb; vb = vd; vd = vt; vt = va; va = vc; vc = vt;
+      thePath = (thePath<<1)|1;
+    } else {
+      /* continue with c,d,b,e: e is written over a */
+      vt = va; va = vc; vc = vb; vb = vd; vd = vt;
+      thePath = thePath<<1;
+    }
+    vd->x = ex; vd->y = ey; vd->z = ez;
+    vd->alt = m->alt;
+    vd->seed = m->seed;
+    level--;
+    aDepth++;
   }
+
+  if (level == 0) alt = (va->alt+vb->alt+vc->alt+vd->alt)/4;
+
+  theContext->levels += aDepth-theTetraDepth;
+  theContext->depths += aDepth;
+
+  return(alt);
 }
 
-double CharackMapGenerator::planet1(double x, double y, double z)
+int CharackMapGenerator::isInsideTetrahedron(const CK_TETRAHEDRON *theTetra, double x, double y, double z)
 {
   double abx,aby,abz, acx,acy,acz, adx,ady,adz, apx,apy,apz;
   double bax,bay,baz, bcx,bcy,bcz, bdx,bdy,bdz, bpx,bpy,bpz;
+  const CK_VERTEX *pa = &theTetra->v[0], *pb = &theTetra->v[1];
+  const CK_VERTEX *pc = &theTetra->v[2], *pd = &theTetra->v[3];
 
-  abx = ssbx-ssax; aby = ssby-ssay; abz = ssbz-ssaz;
-  acx = sscx-ssax; acy = sscy-ssay; acz = sscz-ssaz;
-  adx = ssdx-ssax; ady = ssdy-ssay; adz = ssdz-ssaz;
-  apx = x-ssax; apy = y-ssay; apz = z-ssaz;
+  abx = pb->x-pa->x; aby = pb->y-pa->y; abz = pb->z-pa->z;
+  acx = pc->x-pa->x; acy = pc->y-pa->y; acz = pc->z-pa->z;
+  adx = pd->x-pa->x; ady = pd->y-pa->y; adz = pd->z-pa->z;
+  apx = x-pa->x; apy = y-pa->y; apz = z-pa->z;
   if ((adx*aby*acz+ady*abz*acx+adz*abx*acy
        -adz*aby*acx-ady*abx*acz-adx*abz*acy)*
       (apx*aby*acz+apy*abz*acx+apz*abx*acy
@@ -528,37 +1319,367 @@ double CharackMapGenerator::planet1(double x, double y, double z)
 	   -apz*ady*acx-apy*adx*acz-apx*adz*acy)>0.0){
 	/* p is on same side of acd as b */
 	bax = -abx; bay = -aby; baz = -abz;
-	bcx = sscx-ssbx; bcy = sscy-ssby; bcz = sscz-ssbz;
-	bdx = ssdx-ssbx; bdy = ssdy-ssby; bdz = ssdz-ssbz;
-	bpx = x-ssbx; bpy = y-ssby; bpz = z-ssbz;
+	bcx = pc->x-pb->x; bcy = pc->y-pb->y; bcz = pc->z-pb->z;
+	bdx = pd->x-pb->x; bdy = pd->y-pb->y; bdz = pd->z-pb->z;
+	bpx = x-pb->x; bpy = y-pb->y; bpz = z-pb->z;
 	if ((bax*bcy*bdz+bay*bcz*bdx+baz*bcx*bdy
 	     -baz*bcy*bdx-bay*bcx*bdz-bax*bcz*bdy)*
 	    (bpx*bcy*bdz+bpy*bcz*bdx+bpz*bcx*bdy
 	     -bpz*bcy*bdx-bpy*bcx*bdz-bpx*bcz*bdy)>0.0){
 	  /* p is on same side of bcd as a */
 	  /* Hence, p is inside tetrahedron */
-	  return(planet(ssa,ssb,ssc,ssd, ssas,ssbs,sscs,ssds,
-			ssax,ssay,ssaz, ssbx,ssby,ssbz,
-			sscx,sscy,sscz, ssdx,ssdy,ssdz,
-			x,y,z, 11));
+	  return 1;
 	}
       }
     }
-  } /* otherwise */
-  return(planet(M,M,M,M,
-		/* initial altitude is M on all corners of tetrahedron */
-		r1,r2,r3,r4,
-		     /* same seed set is used in every call */
-		0.0, 0.0, 3.01,
-		0.0, sqrt(8.0)+.01*r1*r1, -1.02+.01*r2*r3,
-		-sqrt(6.0)-.01*r3*r3, -sqrt(2.0)-.01*r4*r4, -1.02+.01*r1*r2,
-		sqrt(6.0)-.01*r2*r2, -sqrt(2.0)-.01*r3*r3, -1.02+.01*r1*r3,
-		/* coordinates of vertices */
-		     x,y,z,
-		     /* coordinates of point we want colour of */
-		Depth));
-		/* subdivision depth */
-
+  }
+  return 0;
+}
+
+// Store the tetrahedron abcd, reached through thePath, as a node of the cache depth theIndex. If
+// the node is already there, it is just marked as used; otherwise it replaces the least recently used node.
+void CharackMapGenerator::cacheNode(CK_NODE_CACHE *theCache, int theIndex, const CK_VERTEX *a, const CK_VERTEX *b, const CK_VERTEX *c, const CK_VERTEX *d, unsigned int thePath)
+{
+  CK_NODE *aNodes = theCache->nodes[theIndex], *aNode = &aNodes[0];
+  int w;
+
+  for (w = 0; w < mNodeCacheWays; w++) {
+    if (aNodes[w].stamp != 0 && aNodes[w].path == thePath) {
+      aNodes[w].stamp = ++theCache->clock;
+      return;
+    }
+    if (aNodes[w].stamp < aNode->stamp) aNode = &aNodes[w];
+  }
+
+  aNode->tetra.v[0] = *a; aNode->tetra.v[1] = *b;
+  aNode->tetra.v[2] = *c; aNode->tetra.v[3] = *d;
+  aNode->path = thePath;
+  aNode->stamp = ++theCache->clock;
+}
+
+// Fill theTetra with the tetrahedron containing the whole globe, where every subdivision starts.
+void CharackMapGenerator::roottetrahedron(CK_TETRAHEDRON *theTetra)
+{
+  /* initial altitude is M on all corners of tetrahedron */
+  theTetra->v[0].alt = theTetra->v[1].alt = theTetra->v[2].alt = theTetra->v[3].alt = M;
+
+  /* same seed set is used in every call */
+  theTetra->v[0].seed = r1; theTetra->v[1].seed = r2; theTetra->v[2].seed = r3; theTetra->v[3].seed = r4;
+
+  /* coordinates of vertices */
+  theTetra->v[0].x = 0.0;                  theTetra->v[0].y = 0.0;                  theTetra->v[0].z = 3.01;
+  theTetra->v[1].x = 0.0;                  theTetra->v[1].y = sqrt(8.0)+.01*r1*r1;  theTetra->v[1].z = -1.02+.01*r2*r3;
+  theTetra->v[2].x = -sqrt(6.0)-.01*r3*r3; theTetra->v[2].y = -sqrt(2.0)-.01*r4*r4; theTetra->v[2].z = -1.02+.01*r1*r2;
+  theTetra->v[3].x = sqrt(6.0)-.01*r2*r2;  theTetra->v[3].y = -sqrt(2.0)-.01*r3*r3; theTetra->v[3].z = -1.02+.01*r1*r3;
+}
+
+// Checks if the sign of the altitude of every point inside the tetrahedron abcd is already known, with level
+// levels to go and theEdge = pow(lab,POW) for its longest edge ab. Since dd1 <= 0.5, a new vertex never goes
+// further than dd2*pow(lab,POW) beyond the altitudes of the vertices, and that term only gets smaller as the
+// edges get shorter. So no point below this level can be further than level*dd2*theEdge from the current
+// altitudes. If the sign is known, theAlt gets an altitude with that sign and 1 is returned.
+int CharackMapGenerator::signdecided(const CK_VERTEX *a, const CK_VERTEX *b, const CK_VERTEX *c, const CK_VERTEX *d, int level, double theEdge, double *theAlt)
+{
+  double lo, hi, bound;
+
+  bound = level*dd2*theEdge*(1.0+1e-9)+1e-12; /* a little bit more, because of rounding */
+  hi = fmax_dov(fmax_dov(a->alt,b->alt),fmax_dov(c->alt,d->alt));
+  if (hi+bound <= 0.0) {
+    *theAlt = hi+bound;
+    return 1;
+  }
+  lo = fmin_dov(fmin_dov(a->alt,b->alt),fmin_dov(c->alt,d->alt));
+  if (lo-bound > 0.0) {
+    *theAlt = lo-bound;
+    return 1;
+  }
+  return 0;
+}
+
+// Find the deepest remembered node (path stack or node cache, depending on mCoherent) containing all the
+// n points, so the descent can start from it. Returns NULL if the descent must start from the root.
+const CK_TETRAHEDRON *CharackMapGenerator::startnode(const double *x, const double *y, const double *z, int n, int theDepth, CK_PLANET_CONTEXT *theContext, int *theNodeDepth, unsigned int *thePath)
+{
+  CK_NODE_CACHE *aCache = &theContext->nodes;
+  CK_PATH_STACK *aPath = &theContext->path;
+  CK_NODE *aNode;
+  int d, w, i, aNodeDepth;
+
+  *theNodeDepth = 0;
+  *thePath = 0;
+
+  if (mCoherent) {
+    /* pop the path of the previous point until a tetrahedron contains the points */
+    while (aPath->size > 0) {
+      d = aPath->size-1;
+      if (d < theDepth) {
+	for (i = 0; i < n && isInsideTetrahedron(&aPath->tetra[d], x[i],y[i],z[i]); i++);
+	if (i == n) {
+	  *theNodeDepth = d;
+	  return(&aPath->tetra[d]);
+	}
+      }
+      aPath->size--;
+    }
+  } else {
+    /* the deepest cached node containing the points, if any */
+    aCache->lookups++;
+    for (d = mNodeCacheDepths-1; d >= 0; d--) {
+      aNodeDepth = (d+1)*mNodeCacheStep;
+      if (aNodeDepth >= theDepth) continue;
+
+      for (w = 0; w < mNodeCacheWays; w++) {
+	aNode = &aCache->nodes[d][w];
+	if (aNode->stamp == 0) continue;
+
+	for (i = 0; i < n && isInsideTetrahedron(&aNode->tetra, x[i],y[i],z[i]); i++);
+	if (i == n) {
+	  aNode->stamp = ++aCache->clock;
+	  aCache->hits[d]++;
+	  *theNodeDepth = aNodeDepth;
+	  *thePath = aNode->path;
+	  return(&aNode->tetra);
+	}
+      }
+    }
+  }
+
+  return(NULL);
+}
+
+double CharackMapGenerator::planet1(double x, double y, double z, int theDepth, CK_PLANET_CONTEXT *theContext)
+{
+  CK_TETRAHEDRON aRoot;
+  const CK_TETRAHEDRON *aStart;
+  int aStartDepth;
+  unsigned int aStartPath;
+
+  theContext->points++;
+
+  aStart = startnode(&x,&y,&z,1,theDepth,theContext,&aStartDepth,&aStartPath);
+  if (aStart == NULL) {
+    roottetrahedron(&aRoot);
+    aStart = &aRoot;
+  }
+
+  /* x,y,z are the coordinates of point we want colour of, theDepth is the subdivision depth */
+  return(planet(aStart, aStartDepth, aStartPath, x,y,z, theDepth-aStartDepth, theContext));
+}
+
+// Returns which points of theMask (bit i is the point x[i],y[i],z[i]) are on the same side of the plane
+// through e, c and d as the vertex a. theSide is the determinant of a, as calculated by planet().
+// The determinants of the points are calculated two at a time when SSE2 is available.
+unsigned int CharackMapGenerator::sideMask(const double *x, const double *y, const double *z, int n, unsigned int theMask, double ex, double ey, double ez, const CK_VERTEX *c, const CK_VERTEX *d, double theSide)
+{
+  double epx,epy,epz;
+  double ecx,ecy,ecz, edx,edy,edz;
+  unsigned int aResult = 0;
+  int i = 0;
+
+  ecx = c->x-ex; ecy = c->y-ey; ecz = c->z-ez;
+  edx = d->x-ex; edy = d->y-ey; edz = d->z-ez;
+
+#ifdef CK_SSE2
+  if (theMask & (theMask-1)) {
+    __m128d aEx = _mm_set1_pd(ex), aEy = _mm_set1_pd(ey), aEz = _mm_set1_pd(ez);
+    __m128d aEcx = _mm_set1_pd(ecx), aEcy = _mm_set1_pd(ecy), aEcz = _mm_set1_pd(ecz);
+    __m128d aEdx = _mm_set1_pd(edx), aEdy = _mm_set1_pd(edy), aEdz = _mm_set1_pd(edz);
+    __m128d aSide = _mm_set1_pd(theSide), aZero = _mm_setzero_pd();
+    __m128d aPx, aPy, aPz, aDet;
+
+    /* the terms are added in the same order as in planet(), so the signs are exactly the same */
+    for (; i+1 < n; i += 2) {
+      if (((theMask>>i)&3) == 0) continue;
+      aPx = _mm_sub_pd(_mm_loadu_pd(x+i), aEx);
+      aPy = _mm_sub_pd(_mm_loadu_pd(y+i), aEy);
+      aPz = _mm_sub_pd(_mm_loadu_pd(z+i), aEz);
+      aDet = _mm_mul_pd(_mm_mul_pd(aPx, aEcy), aEdz);
+      aDet = _mm_add_pd(aDet, _mm_mul_pd(_mm_mul_pd(aPy, aEcz), aEdx));
+      aDet = _mm_add_pd(aDet, _mm_mul_pd(_mm_mul_pd(aPz, aEcx), aEdy));
+      aDet = _mm_sub_pd(aDet, _mm_mul_pd(_mm_mul_pd(aPz, aEcy), aEdx));
+      aDet = _mm_sub_pd(aDet, _mm_mul_pd(_mm_mul_pd(aPy, aEcx), aEdz));
+      aDet = _mm_sub_pd(aDet, _mm_mul_pd(_mm_mul_pd(aPx, aEcz), aEdy));
+      aResult |= (unsigned int)_mm_movemask_pd(_mm_cmpgt_pd(_mm_mul_pd(aSide, aDet), aZero)) << i;
+    }
+  }
+#endif
+
+  for (; i < n; i++) {
+    if (((theMask>>i)&1) == 0) continue;
+    epx = x[i]-ex; epy = y[i]-ey; epz = z[i]-ez;
+    if (theSide*
+	(epx*ecy*edz+epy*ecz*edx+epz*ecx*edy
+	 -epz*ecy*edx-epy*ecx*edz-epx*ecz*edy)>0.0)
+      aResult |= 1u<<i;
+  }
+
+  return(aResult & theMask);
+}
+
+// The same as planet1(), but for the n points x[i],y[i],z[i] at once (n <= 32). All points start from the deepest
+// remembered node containing them and descend together, so the expensive part of each level (reordering,
+// splitting the edge and calculating the new altitude) is done once for the whole group. When the points
+// of a group end up in different halves of a tetrahedron, the group is split in two.
+//
+// In coherent mode the nodes go to the path stack instead of the node cache, and a group starts from the path
+// of its first point, so it only takes the points after it inside the same tetrahedron (the others start
+// new groups). The groups are taken last in, first out, so the ones taken between a split and its second
+// half only write below the split, and the stack always holds the ancestors of the group being descended.
+void CharackMapGenerator::planetBatch(const double *x, const double *y, const double *z, double *out, int n, int theDepth, CK_PLANET_CONTEXT *theContext)
+{
+  CK_BATCH_GROUP aGroups[CK_MAP_BATCH], *g;
+  CK_TETRAHEDRON t;
+  CK_VERTEX *va, *vb, *vc, *vd, *vt; /* the vertices of t acting as a, b, c and d */
+  const CK_TETRAHEDRON *aStart;
+  double abx,aby,abz, acx,acy,acz, adx,ady,adz;
+  double bcx,bcy,bcz, bdx,bdy,bdz, cdx,cdy,cdz;
+  double lab, lac, lad, lbc, lbd, lcd;
+  double ex, ey, ez;
+  double eax,eay,eaz, ecx,ecy,ecz, edx,edy,edz;
+  double alt;
+  const CK_EDGE *m;
+  CK_EDGE aSpare;
+  CK_PATH_STACK *aPath = &theContext->path;
+  unsigned int aLast, aSide, mask, path;
+  int aGroupCount, aGroupDepth, aDepth, level, i, aFirst, k;
+
+  theContext->points += n;
+
+  for (aFirst = 0; aFirst < n; aFirst += k) {
+    g = &aGroups[0];
+    if (mCoherent) {
+      /* the first point starts where its path leaves the one of the previous point, and the points after
+	 it join the group as long as they are inside the same tetrahedron */
+      aStart = startnode(x+aFirst,y+aFirst,z+aFirst,1,theDepth,theContext,&g->depth,&g->path);
+      for (k = 1; aFirst+k < n && (aStart == NULL || isInsideTetrahedron(aStart,x[aFirst+k],y[aFirst+k],z[aFirst+k])); k++);
+    } else {
+      k = n;
+      aStart = startnode(x,y,z,n,theDepth,theContext,&g->depth,&g->path);
+    }
+    if (aStart == NULL)
+      roottetrahedron(&g->tetra);
+    else
+      g->tetra = *aStart;
+    aLast = 1u<<(aFirst+k-1);
+    g->level = theDepth-g->depth;
+    g->mask = (aLast | (aLast-1)) & ~((1u<<aFirst)-1);
+    aGroupCount = 1;
+
+    while (aGroupCount > 0) {
+      g = &aGroups[--aGroupCount];
+      t = g->tetra; aGroupDepth = aDepth = g->depth; level = g->level; path = g->path; mask = g->mask;
+      va = &t.v[0]; vb = &t.v[1]; vc = &t.v[2]; vd = &t.v[3];
+
+      while (level>0) {
+	abx = va->x-vb->x; aby = va->y-vb->y; abz = va->z-vb->z;
+	acx = va->x-vc->x; acy = va->y-vc->y; acz = va->z-vc->z;
+	lab = abx*abx+aby*aby+abz*abz;
+	lac = acx*acx+acy*acy+acz*acz;
+
+	/* reorder the vertices until ab is the longest edge */
+	if (lab<lac) {
+	  vt = vb; vb = vc; vc = vt;                          /* a,c,b,d */
+	  continue;
+	}
+	adx = va->x-vd->x; ady = va->y-vd->y; adz = va->z-vd->z;
+	lad = adx*adx+ady*ady+adz*adz;
+	if (lab<lad) {
+	  vt = vb; vb = vd; vd = vc; vc = vt;                 /* a,d,b,c */
+	  continue;
+	}
+	bcx = vb->x-vc->x; bcy = vb->y-vc->y; bcz = vb->z-vc->z;
+	lbc = bcx*bcx+bcy*bcy+bcz*bcz;
+	if (lab<lbc) {
+	  vt = va; va = vb; vb = vc; vc = vt;                 /* b,c,a,d */
+	  continue;
+	}
+	bdx = vb->x-vd->x; bdy = vb->y-vd->y; bdz = vb->z-vd->z;
+	lbd = bdx*bdx+bdy*bdy+bdz*bdz;
+	if (lab<lbd) {
+	  vt = va; va = vb; vb = vd; vd = vc; vc = vt;        /* b,d,a,c */
+	  continue;
+	}
+	cdx = vc->x-vd->x; cdy = vc->y-vd->y; cdz = vc->z-vd->z;
+	lcd = cdx*cdx+cdy*cdy+cdz*cdz;
+	if (lab<lcd) {
+	  vt = va; va = vc; vc = vt; vt = vb; vb = vd; vd = vt; /* c,d,a,b */
+	  continue;
+	}
+
+	if (mCoherent) {
+	  if (aDepth < CK_PATH_MAX_DEPTH) {
+	    aPath->tetra[aDepth].v[0] = *va; aPath->tetra[aDepth].v[1] = *vb;
+	    aPath->tetra[aDepth].v[2] = *vc; aPath->tetra[aDepth].v[3] = *vd;
+	    aPath->size = aDepth+1;
+	  }
+	} else if (aDepth > aGroupDepth && aDepth <= mNodeCacheStep*mNodeCacheDepths && aDepth % mNodeCacheStep == 0) {
+	  cacheNode(&theContext->nodes, aDepth/mNodeCacheStep - 1, va, vb, vc, vd, path);
+	}
+
+	/* split ab at e */
+	m = edgemidpoint(va,vb,lab,theContext,&aSpare);
+	if (mSignOnly && signdecided(va, vb, vc, vd, level, m->lp, &alt)) break;
+
+	ex = m->x; ey = m->y; ez = m->z;
+	eax = va->x-ex; eay = va->y-ey; eaz = va->z-ez;
+	ecx = vc->x-ex; ecy = vc->y-ey; ecz = vc->z-ez;
+	edx = vd->x-ex; edy = vd->y-ey; edz = vd->z-ez;
+	aSide = sideMask(x,y,z,n,mask,ex,ey,ez,vc,vd,
+			 eax*ecy*edz+eay*ecz*edx+eaz*ecx*edy
+			 -eaz*ecy*edx-eay*ecx*edz-eax*ecz*edy);
+
+	if (aSide != 0 && aSide != mask) {
+	  /* the side with the last point goes on later as a new group, so the last group is always the one
+	     of the last point and the path stack ends with its path, right next to the points of the next batch */
+	  g = &aGroups[aGroupCount++];
+	  if (aSide & aLast) {
+	    /* the side of a, with c,d,a,e */
+	    g->tetra.v[0] = *vc; g->tetra.v[1] = *vd; g->tetra.v[2] = *va;
+	    g->path = (path<<1)|1;
+	    g->mask = aSide;
+	    mask &= ~aSide;
+	    aSide = 0;
+	  } else {
+	    /* the side of b, with c,d,b,e */
+	    g->tetra.v[0] = *vc; g->tetra.v[1] = *vd; g->tetra.v[2] = *vb;
+	    g->path = path<<1;
+	    g->mask = mask & ~aSide;
+	    mask = aSide;
+	  }
+	  g->tetra.v[3].x = ex; g->tetra.v[3].y = ey; g->tetra.v[3].z = ez;
+	  g->tetra.v[3].alt = m->alt;
+	  g->tetra.v[3].seed = m->seed;
+	  g->depth = aDepth+1;
+	  g->level = level-1;
+	}
+
+	if (aSide != 0) {
+	  /* continue with c,d,a,e: e is written over b */
+	  vt = vb; vb = vd; vd = vt; vt = va; va = vc; vc = vt;
+	  path = (path<<1)|1;
+	} else {
+	  /* continue with c,d,b,e: e is written over a */
+	  vt = va; va = vc; vc = vb; vb = vd; vd = vt;
+	  path = path<<1;
+	}
+	vd->x = ex; vd->y = ey; vd->z = ez;
+	vd->alt = m->alt;
+	vd->seed = m->seed;
+	level--;
+	aDepth++;
+      }
+
+      if (level == 0) alt = (va->alt+vb->alt+vc->alt+vd->alt)/4;
+
+      theContext->levels += aDepth-aGroupDepth;
+      for (i = 0; i < n; i++) {
+	if ((mask>>i)&1) {
+	  out[i] = alt;
+	  theContext->depths += aDepth;
+	}
+      }
+    }
+  }
 }
 
 
@@ -570,122 +1691,124 @@ double CharackMapGenerator::rand2(double p, double q) /* random number generator
   return(2.*(r-(int)r)-1.);
 }
 
-void CharackMapGenerator::printbmpBW(FILE *outfile) /* prints picture in b/w BMP format */
+void CharackMapGenerator::putint(unsigned char *out, int value, int bytes) /* little endian, as BMP wants */
+{
+  int i;
+
+  for (i=0; i<bytes; i++)
+    out[i] = (value>>(8*i))&255;
+}
+
+int CharackMapGenerator::printppm(const CK_EXPORT_JOB *job, FILE *outfile) /* prints picture in PPM (portable pixmap) format */
+{
+  int i,j,c,ok;
+  unsigned char *row, *p;
+
+  fprintf(outfile,"P6\n");
+  fprintf(outfile,"#fractal planet image\n");
+  fprintf(outfile,"%d %d 255\n",job->width,job->height);
+
+  row = (unsigned char*)malloc(3*job->width);
+  if (row == NULL) return(0);
+
+  /* each row is converted in memory and written with a single fwrite() */
+  ok = 1;
+  for (j=0; j<job->height && ok; j++) {
+    p = job->pixels+j*job->width;
+    for (i=0; i<job->width; i++) {
+      c = p[i];
+      row[3*i] = job->r[c];
+      row[3*i+1] = job->g[c];
+      row[3*i+2] = job->b[c];
+    }
+    ok = fwrite(row,1,3*job->width,outfile) == (size_t)(3*job->width);
+  }
+
+  free(row);
+  return(ok);
+}
+
+int CharackMapGenerator::printbmp(const CK_EXPORT_JOB *job, FILE *outfile) /* prints picture in 24 bit BMP format */
 {
-  int i,j,c,s, W1;
+  int i,j,c,s,W3,ok;
+  unsigned char header[54], *row, *p;
+
+  W3 = (3*job->width+3) & ~3; /* rows are padded to 4 bytes */
+  s = 54+W3*job->height; /* file size */
+
+  memset(header,0,sizeof(header));
+  header[0] = 'B'; header[1] = 'M';
+  putint(header+2,s,4);
+  putint(header+10,54,4); /* offset to data */
+  putint(header+14,40,4); /* size of infoheader */
+  putint(header+18,job->width,4);
+  putint(header+22,job->height,4);
+  putint(header+26,1,2); /* no. of planes = 1 */
+  putint(header+28,24,2); /* bpp */
+  putint(header+38,8192,4); /* h. pixels/m */
+  putint(header+42,8192,4); /* v. pixels/m */
+
+  row = (unsigned char*)calloc(W3,1);
+  if (row == NULL) return(0);
+
+  ok = fwrite(header,1,54,outfile) == 54;
+  for (j=job->height-1; j>=0 && ok; j--) {
+    p = job->pixels+j*job->width;
+    for (i=0; i<job->width; i++) {
+      c = p[i];
+      row[3*i] = job->b[c];
+      row[3*i+1] = job->g[c];
+      row[3*i+2] = job->r[c];
+    }
+    ok = fwrite(row,1,W3,outfile) == (size_t)W3;
+  }
+
+  free(row);
+  return(ok);
+}
 
-  fprintf(outfile,"BM");
+int CharackMapGenerator::printbmpBW(const CK_EXPORT_JOB *job, FILE *outfile) /* prints picture in b/w BMP format */
+{
+  int i,j,c,s,W1,ok;
+  unsigned char header[62], *row, *p;
 
-  W1 = (Width+31);
+  W1 = (job->width+31);
   W1 -= W1 % 32;
-  s = 62+(W1*Height)/8; /* file size */
-  putc(s&255,outfile);
-  putc((s>>8)&255,outfile);
-  putc((s>>16)&255,outfile);
-  putc(s>>24,outfile);
-
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(62,outfile); /* offset to data */
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(40,outfile); /* size of infoheader */
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(Width&255,outfile);
-  putc((Width>>8)&255,outfile);
-  putc((Width>>16)&255,outfile);
-  putc(Width>>24,outfile);
-
-  putc(Height&255,outfile);
-  putc((Height>>8)&255,outfile);
-  putc((Height>>16)&255,outfile);
-  putc(Height>>24,outfile);
-
-  putc(1,outfile);  /* no. of planes = 1 */
-  putc(0,outfile);
-
-  putc(1,outfile);  /* bpp */
-  putc(0,outfile);  
-
-  putc(0,outfile); /* no compression */
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(0,outfile); /* image size (unspecified) */
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(0,outfile); /* h. pixels/m */
-  putc(32,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(0,outfile); /* v. pixels/m */
-  putc(32,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(2,outfile); /* colours used */
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-
-  putc(2,outfile); /* important colours (2) */
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(0,outfile); /* colour 0 = black */
-  putc(0,outfile);
-  putc(0,outfile);
-  putc(0,outfile);
-
-  putc(255,outfile); /* colour 1 = white */
-  putc(255,outfile);
-  putc(255,outfile);
-  putc(255,outfile);
-
-  for (j=Height-1; j>=0; j--)
-    for (i=0; i<W1; i+=8) {
-      if (i<Width && col[i][j] != BLACK && col[i][j] != GRID
-	  && col[i][j] != BACK)
-	c=128;
-      else c=0;
-      if (i+1<Width && col[i+1][j] != BLACK && col[i+1][j] != GRID
-	  && col[i+1][j] != BACK)
-	c+=64;
-      if (i+2<Width && col[i+2][j] != BLACK && col[i+2][j] != GRID
-	  && col[i+2][j] != BACK)
-	c+=32;
-      if (i+3<Width && col[i+3][j] != BLACK && col[i+3][j] != GRID
-	  && col[i+3][j] != BACK)
-	c+=16;
-      if (i+4<Width && col[i+4][j] != BLACK && col[i+4][j] != GRID
-	  && col[i+4][j] != BACK)
-	c+=8;
-      if (i+5<Width && col[i+5][j] != BLACK && col[i+5][j] != GRID
-	  && col[i+5][j] != BACK)
-	c+=4;
-      if (i+6<Width && col[i+6][j] != BLACK && col[i+6][j] != GRID
-	  && col[i+6][j] != BACK)
-	c+=2;
-      if (i+7<Width && col[i+7][j] != BLACK && col[i+7][j] != GRID
-	  && col[i+7][j] != BACK)
-	c+=1;
-      putc(c,outfile);
-    }
-  fclose(outfile);
+  s = 62+(W1*job->height)/8; /* file size */
+
+  memset(header,0,sizeof(header));
+  header[0] = 'B'; header[1] = 'M';
+  putint(header+2,s,4);
+  putint(header+10,62,4); /* offset to data */
+  putint(header+14,40,4); /* size of infoheader */
+  putint(header+18,job->width,4);
+  putint(header+22,job->height,4);
+  putint(header+26,1,2); /* no. of planes = 1 */
+  putint(header+28,1,2); /* bpp */
+  putint(header+38,8192,4); /* h. pixels/m */
+  putint(header+42,8192,4); /* v. pixels/m */
+  putint(header+46,2,4); /* colours used */
+  putint(header+50,2,4); /* important colours (2) */
+  putint(header+54,0,4); /* colour 0 = black */
+  putint(header+58,0xFFFFFF,4); /* colour 1 = white */
+
+  row = (unsigned char*)malloc(W1/8);
+  if (row == NULL) return(0);
+
+  ok = fwrite(header,1,62,outfile) == 62;
+  for (j=job->height-1; j>=0 && ok; j--) {
+    p = job->pixels+j*job->width;
+    memset(row,0,W1/8);
+    for (i=0; i<job->width; i++) {
+      c = p[i];
+      if (c != BLACK && c != GRID && c != BACK)
+	row[i>>3] |= 128>>(i&7);
+    }
+    ok = fwrite(row,1,W1/8,outfile) == (size_t)(W1/8);
+  }
+
+  free(row);
+  return(ok);
 }
       
 double CharackMapGenerator::log_2(double x)
@@ -702,7 +1825,7 @@ int CharackMapGenerator::max_dov(int x, int y)
 double CharackMapGenerator::fmin_dov(double x, double y)
 { return(x<y ? x : y); }
 
-double fmax_dov(double x, double y)
+double CharackMapGenerator::fmax_dov(double x, double y)
 { return(x<y ? y : x); }
 
 
@@ -719,154 +1842,1431 @@ int CharackMapGenerator::globalIsLand(float theX, float theZ) {
 	aX = aX >= Width	? Width	-1 : aX;
 	aZ = aZ >= Height	? Height -1 : aZ;
 
-	return col[aZ][aX] == BLACK;
+	// In the lazy mode the tile is only generated the first time one of its pixels is used.
+	if(mTiles != NULL) {
+		prepareTile((aX / CK_MAP_TILE_SIZE) * mTilesX + aZ / CK_MAP_TILE_SIZE);
+	}
+
+	return landBit(aZ, aX);
 }
 
-int CharackMapGenerator::isLand(float theX, float theZ) {
-	// TODO: the method. For now, we use the information of a macro world view.
-	return globalIsLand(theX, theZ);
+void CharackMapGenerator::allocLandMask(void) {
+	free(mLandMask);
+	sizeLandMask();
+	mLandMask = (unsigned long long*)calloc(mLandMaskWords, sizeof(unsigned long long));
 }
 
+void CharackMapGenerator::sizeLandMask(void) {
+	// The stride is the number of words of a row (rows), of a column (columns) or of tiles in a row of tiles (morton).
+	switch(mMaskLayout) {
+		case CK_MASK_COLUMNS:
+			mLandMaskStride	= (Height + 63) / 64;
+			mLandMaskWords	= mLandMaskStride * Width;
+			break;
 
+		case CK_MASK_MORTON:
+			mLandMaskStride	= (Width + 63) / 64;
+			mLandMaskWords	= mLandMaskStride * ((Height + 63) / 64) * 64;
+			break;
 
-void CharackMapGenerator::clearCoastMap() {
-	for(int i = 0; i < CK_VIEW_FRUSTUM; i++) {
-		for(int j = 0; j < CK_VIEW_FRUSTUM; j++) {
-			mCoastMap[i][j] = 0;
-		}
+		default:
+			mLandMaskStride	= (Width + 63) / 64;
+			mLandMaskWords	= mLandMaskStride * Height;
+			break;
 	}
 }
 
-void CharackMapGenerator::applyCoast(int theMapX, int theMapZ, int theViewFrustum, int theSample) {
-	std::list<CharackLineSegment> aCoastLines;
-	std::list<CharackLineSegment>::iterator i;
-	std::list<Vector3> aNewCoastPoints;
+unsigned int CharackMapGenerator::morton(int theX, int theY) {
+	unsigned int x = theX, y = theY;
 
-	// First of all, we clean up the coast map
-	clearCoastMap();
+	x = (x | (x << 8)) & 0x00FF00FF; y = (y | (y << 8)) & 0x00FF00FF;
+	x = (x | (x << 4)) & 0x0F0F0F0F; y = (y | (y << 4)) & 0x0F0F0F0F;
+	x = (x | (x << 2)) & 0x33333333; y = (y | (y << 2)) & 0x33333333;
+	x = (x | (x << 1)) & 0x55555555; y = (y | (y << 1)) & 0x55555555;
+
+	return x | (y << 1);
+}
 
-	aCoastLines = findCoastLines(theMapX, theMapZ, theViewFrustum, theSample);
+unsigned long CharackMapGenerator::maskOffset(int i, int j) {
+	switch(mMaskLayout) {
+		case CK_MASK_COLUMNS:
+			return ((unsigned long)i * mLandMaskStride << 6) + j;
 
-	// For each coast line, apply the midpoint displacement algorithm to create a noised line,
-	// which looks pretty much the same as a real coast line.
-	for(i = aCoastLines.begin(); i != aCoastLines.end(); i++) {
-		CharackLineSegment aLine = (*i);
-		aNewCoastPoints = getCoastGenerator().generate(aLine.getPointA(), aLine.getPointB(), aLine.getOrientationAxis());
+		case CK_MASK_MORTON:
+			// Tiles of 64x64 pixels, row by row, with the pixels of a tile in Z-order, so each word is a block of 8x8 pixels.
+			return ((unsigned long)((j >> 6) * mLandMaskStride + (i >> 6)) << 12) + morton(i & 63, j & 63);
 
-		// Now that we know the points of the new coast, we have to apply them to the coast
-		// map (and, as a consequence, create the lines among the points). In the end, the
-		// coast map will give us the information isLand() needs to tell anyone what is
-		// water and what is land.
-		updateCoastMap(aNewCoastPoints);
+		default:
+			return ((unsigned long)j * mLandMaskStride << 6) + i;
 	}
 }
 
-std::list<CharackLineSegment> CharackMapGenerator::findCoastLines(int theMapX, int theMapZ, int theViewFrustum, int theSample) {
-	Vector3 aStart, aTop, aBottom;
-	std::list<Vector3> aCorners;
-	
-	aStart	= findCoast(theMapX, theMapZ, theViewFrustum, theSample);
-	
-	aTop	= isCorner(aStart) ? aStart : findLineCorner(aStart, MOVE_UP,	AXIS_Z); 
-	aBottom	= isCorner(aStart) ? aStart : findLineCorner(aStart, MOVE_DOWN, AXIS_Z); 
+int CharackMapGenerator::landBit(int i, int j) {
+	unsigned long aOffset = maskOffset(i, j);
+	return (int)((mLandMask[aOffset >> 6] >> (aOffset & 63)) & 1);
+}
+
+void CharackMapGenerator::setMaskLayout(int theLayout) {
+	int i;
+
+	mMaskLayout = theLayout;
 
-	findCorners(aCorners, aTop,		VERTICAL, INSERT_BEGIN);
-	findCorners(aCorners, aBottom,	VERTICAL, INSERT_END);
-	
-	// TODO: convert corners into segments (aCorners)
-	
-	std::list<CharackLineSegment> aCoastLines;
-	return aCoastLines;
+	// If there is a map already, its land mask is built again with the new layout.
+	if(mLandMask != NULL) {
+		detachCache();
+		allocLandMask();
+
+		if(mTiles == NULL) {
+			packLandMask(0, 0, Width, Height);
+		} else {
+			for(i = 0; i < mTilesX * mTilesY; i++) {
+				if(mTiles[i]) {
+					packLandMask((i % mTilesX) * CK_MAP_TILE_SIZE, (i / mTilesX) * CK_MAP_TILE_SIZE, min_dov((i % mTilesX + 1) * CK_MAP_TILE_SIZE, Width), min_dov((i / mTilesX + 1) * CK_MAP_TILE_SIZE, Height));
+				}
+			}
+		}
+	}
 }
 
-void CharackMapGenerator::findCorners(std::list<Vector3> theCorners, Vector3 thePoint, int theDirection, int theListInsertOrder) {
-	int aSign;
+void CharackMapGenerator::benchmarkMaskLayouts(int theViewFrustum) {
+	static const char *aNames[] = {"rows", "columns", "morton"};
+	static const int aSamples[] = {1, 10, 100, 1000, 3750, 15000};
+	int aOldLayout = mMaskLayout, aLayout, aOrder, s, p, x, z, aLand = 0;
+	float aMapX, aMapZ, aCenter;
+	clock_t aStart;
+
+	// Every pixel must be there, even for the lazy map.
+	prepareTiles(0, 0, Width, Height);
+
+	printf("--- Charack Map Generator (land mask layouts) ---\n\n");
+	printf("Map = %dx%d, view frustum = %d, %d positions per test (ms per CharackWorld::generateMap())\n", Width, Height, theViewFrustum, CK_BENCHMARK_POSITIONS);
+	printf("%-8s %-8s", "layout", "loop");
+	for(s = 0; s < (int)(sizeof(aSamples) / sizeof(int)); s++) {
+		printf(" %8d", aSamples[s]);
+	}
+	printf("\n");
 
-	do {
-		if(isCorner(thePoint)) {
-			if(theListInsertOrder == INSERT_BEGIN) {
-				theCorners.push_front(thePoint);
-			} else {
-				theCorners.push_back(thePoint);
+	for(aLayout = CK_MASK_ROWS; aLayout <= CK_MASK_MORTON; aLayout++) {
+		setMaskLayout(aLayout);
+
+		// The order of CharackWorld::generateMap() (x outside, z inside) and the transposed one.
+		for(aOrder = 0; aOrder < 2; aOrder++) {
+			printf("%-8s %-8s", aNames[aLayout], aOrder ? "z, x" : "x, z");
+
+			for(s = 0; s < (int)(sizeof(aSamples) / sizeof(int)); s++) {
+				aStart = clock();
+
+				for(p = 0; p < CK_BENCHMARK_POSITIONS; p++) {
+					aCenter = (float)CK_MAX_WIDTH * (p + 0.5f) / CK_BENCHMARK_POSITIONS;
+
+					for(x = 0; x < theViewFrustum; x++) {
+						for(z = 0; z < theViewFrustum; z++) {
+							aMapX = aCenter + ((aOrder ? z : x) - theViewFrustum/2) * aSamples[s];
+							aMapZ = aCenter + ((aOrder ? x : z) - theViewFrustum/2) * aSamples[s];
+							aLand += globalIsLand(aMapX, aMapZ);
+						}
+					}
+				}
+
+				printf(" %8.3f", 1000.0 * (clock() - aStart) / CLOCKS_PER_SEC / CK_BENCHMARK_POSITIONS);
 			}
+			printf("\n");
+		}
+	}
+
+	printf("\n(%d land samples)\n", aLand);
+	setMaskLayout(aOldLayout);
+}
+
+unsigned long long CharackMapGenerator::cacheKey(CK_MAP_CACHE_KEY *theKey) {
+	unsigned char *aBytes = (unsigned char*)theKey;
+	unsigned long long aHash = 14695981039346656037ULL;
+	size_t i;
+
+	// Everything that changes the generated map (memset() clears the padding, so it can be hashed and compared).
+	memset(theKey, 0, sizeof(CK_MAP_CACHE_KEY));
+	theKey->rseed		= rseed;
+	theKey->M			= M;
+	theKey->dd1			= dd1;
+	theKey->dd2			= dd2;
+	theKey->POW			= POW;
+	theKey->longi		= longi;
+	theKey->lat			= lat;
+	theKey->scale		= scale;
+	theKey->width		= Width;
+	theKey->height		= Height;
+	theKey->maskLayout	= mMaskLayout;
+	theKey->altitude	= mKeepAltitude;
+	theKey->seaLevel	= mSeaLevel;
+
+	// FNV-1a
+	for(i = 0; i < sizeof(CK_MAP_CACHE_KEY); i++) {
+		aHash ^= aBytes[i];
+		aHash *= 1099511628211ULL;
+	}
+
+	return aHash;
+}
+
+void *CharackMapGenerator::mapFile(const char *thePath, size_t *theSize) {
+	void *aView = NULL;
+
+#ifdef _WIN32
+	HANDLE aFile, aMapping;
+	LARGE_INTEGER aSize;
+
+	aFile = CreateFileA(thePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(aFile == INVALID_HANDLE_VALUE) {
+		return NULL;
+	}
+
+	if(GetFileSizeEx(aFile, &aSize) && aSize.QuadPart > 0) {
+		aMapping = CreateFileMappingA(aFile, NULL, PAGE_READONLY, 0, 0, NULL);
 
-			theDirection = (theDirection == VERTICAL ? HORIZONTAL : VERTICAL);
+		if(aMapping != NULL) {
+			aView = MapViewOfFile(aMapping, FILE_MAP_READ, 0, 0, 0);
+			*theSize = (size_t)aSize.QuadPart;
+			CloseHandle(aMapping);
 		}
+	}
+	CloseHandle(aFile);
+#else
+	struct stat aStat;
+	int aFile;
+
+	aFile = open(thePath, O_RDONLY);
+	if(aFile < 0) {
+		return NULL;
+	}
 
-		if(isInsideViewFrustum(thePoint)) {
-			if(theDirection == CharackMapGenerator::VERTICAL) {
-				thePoint = findLineCorner(thePoint, canGoDown(thePoint) ? MOVE_DOWN : MOVE_UP, AXIS_Z);
-			} else {
-				thePoint = findLineCorner(thePoint, canGoLeft(thePoint) ? MOVE_LEFT : MOVE_RIGHT, AXIS_X);
-			}
+	if(fstat(aFile, &aStat) == 0 && aStat.st_size > 0) {
+		aView = mmap(NULL, aStat.st_size, PROT_READ, MAP_SHARED, aFile, 0);
+		*theSize = aStat.st_size;
+
+		if(aView == MAP_FAILED) {
+			aView = NULL;
 		}
-	} while (!inList(theCorners, thePoint));
+	}
+	close(aFile);
+#endif
+
+	return aView;
 }
 
-int CharackMapGenerator::isInsideViewFrustum(Vector3 thePoint) {
-	// TODO: the method
-	return 0;
+void CharackMapGenerator::unmapFile(void *theView, size_t theSize) {
+#ifdef _WIN32
+	UnmapViewOfFile(theView);
+#else
+	munmap(theView, theSize);
+#endif
 }
 
-int CharackMapGenerator::isCorner(Vector3 thePoint) {
-	// TODO: the method
-	return 0;
+int CharackMapGenerator::loadCache(void) {
+	CK_MAP_CACHE_HEADER *aHeader;
+	CK_MAP_CACHE_KEY aKey;
+	unsigned char *aView;
+	size_t aSize;
+	int j;
+
+	sprintf(mCachePath, "%s/charack-%016llx.map", mCacheDir, cacheKey(&aKey));
+
+	aView = (unsigned char*)mapFile(mCachePath, &aSize);
+	if(aView == NULL) {
+		return 0;
+	}
+
+	// Files of other versions, other parameters (a hash collision) or that were cut short are ignored, they will be replaced.
+	aHeader = (CK_MAP_CACHE_HEADER*)aView;
+	if(aSize < sizeof(CK_MAP_CACHE_HEADER) || memcmp(aHeader->magic, CK_CACHE_MAGIC, sizeof(aHeader->magic)) != 0 ||
+	   aHeader->version != CK_CACHE_VERSION || memcmp(&aHeader->key, &aKey, sizeof(CK_MAP_CACHE_KEY)) != 0 || aHeader->size != aSize) {
+		unmapFile(aView, aSize);
+		return 0;
+	}
+
+	freeMap();
+
+	sizeLandMask();
+	sizePyramid();
+	mMapStride	= aHeader->stride;
+	col			= (unsigned char**)malloc(Height * sizeof(unsigned char*));
+
+	if(col == NULL || aHeader->maskWords != mLandMaskWords || aHeader->pyramidBytes != mPyramidOffset[mPyramidLevels + 1]) {
+		free(col);
+		col = NULL;
+		unmapFile(aView, aSize);
+		return 0;
+	}
+
+	// The map, the land mask and the pyramid are used right from the file, so every process reading it shares the same pages.
+	mMap		= aView + aHeader->mapOffset;
+	mLandMask	= (unsigned long long*)(aView + aHeader->maskOffset);
+	mPyramid	= aView + aHeader->pyramidOffset;
+	mAltitude	= mKeepAltitude ? (float*)(aView + aHeader->altitudeOffset) : NULL;
+	mCacheView	= aView;
+	mCacheSize	= aSize;
+
+	for(j = 0; j < Height; j++) {
+		col[j] = mMap + j * mMapStride;
+	}
+
+	mMapWidth	= Width;
+	mMapHeight	= Height;
+
+	return 1;
 }
 
-int CharackMapGenerator::canGoDown(Vector3 thePoint) {
-	//TODO: the method
-	return 0;
+void CharackMapGenerator::saveCache(void) {
+	static const unsigned char aZeros[CK_MAP_ALIGN] = {0};
+	CK_MAP_CACHE_HEADER aHeader;
+	char aTemp[CK_CACHE_PATH_MAX + 32];
+	FILE *aFile;
+	int j, aOk;
+
+	memset(&aHeader, 0, sizeof(CK_MAP_CACHE_HEADER));
+	memcpy(aHeader.magic, CK_CACHE_MAGIC, sizeof(aHeader.magic));
+	aHeader.version			= CK_CACHE_VERSION;
+	aHeader.stride			= mMapStride;
+	aHeader.maskWords		= mLandMaskWords;
+	aHeader.pyramidBytes	= mPyramidOffset[mPyramidLevels + 1];
+	aHeader.mapOffset		= (sizeof(CK_MAP_CACHE_HEADER) + CK_MAP_ALIGN - 1) / CK_MAP_ALIGN * CK_MAP_ALIGN;
+	aHeader.maskOffset		= aHeader.mapOffset + (unsigned long long)mMapStride * Height;
+	aHeader.pyramidOffset	= aHeader.maskOffset + (unsigned long long)mLandMaskWords * sizeof(unsigned long long);
+	aHeader.altitudeOffset	= (aHeader.pyramidOffset + aHeader.pyramidBytes + sizeof(float) - 1) / sizeof(float) * sizeof(float);
+	aHeader.size			= mAltitude != NULL ? aHeader.altitudeOffset + (unsigned long long)Width * Height * sizeof(float) : aHeader.altitudeOffset;
+
+	sprintf(mCachePath, "%s/charack-%016llx.map", mCacheDir, cacheKey(&aHeader.key));
+
+	// The file is written with a temporary name and then renamed, so other processes never see half of it.
+#ifdef _WIN32
+	sprintf(aTemp, "%s.%lu.tmp", mCachePath, (unsigned long)GetCurrentProcessId());
+#else
+	sprintf(aTemp, "%s.%lu.tmp", mCachePath, (unsigned long)getpid());
+#endif
+
+	aFile = fopen(aTemp, "wb");
+	if(aFile == NULL) {
+		fprintf(stderr, "Could not write the map cache %s, error code = %d\n", aTemp, errno);
+		return;
+	}
+
+	fwrite(&aHeader, sizeof(CK_MAP_CACHE_HEADER), 1, aFile);
+	fwrite(aZeros, 1, (size_t)(aHeader.mapOffset - sizeof(CK_MAP_CACHE_HEADER)), aFile);
+	for(j = 0; j < Height; j++) {
+		fwrite(col[j], 1, mMapStride, aFile);
+	}
+	fwrite(mLandMask, sizeof(unsigned long long), mLandMaskWords, aFile);
+	fwrite(mPyramid, 1, aHeader.pyramidBytes, aFile);
+	fwrite(aZeros, 1, (size_t)(aHeader.altitudeOffset - aHeader.pyramidOffset - aHeader.pyramidBytes), aFile);
+	if(mAltitude != NULL) {
+		fwrite(mAltitude, sizeof(float), Width * Height, aFile);
+	}
+
+	aOk = !ferror(aFile);
+	aOk = fclose(aFile) == 0 && aOk;
+
+#ifdef _WIN32
+	aOk = aOk && MoveFileExA(aTemp, mCachePath, MOVEFILE_REPLACE_EXISTING);
+#else
+	aOk = aOk && rename(aTemp, mCachePath) == 0;
+#endif
+
+	if(!aOk) {
+		fprintf(stderr, "Could not write the map cache %s, error code = %d\n", mCachePath, errno);
+		remove(aTemp);
+	}
 }
 
-int CharackMapGenerator::canGoLeft(Vector3 thePoint) {
-	//TODO: the method
-	return 0;
+void CharackMapGenerator::detachCache(void) {
+	unsigned char **aCol = col, *aPyramid = mPyramid;
+	unsigned long long *aMask = mLandMask;
+	float *aAltitude = mAltitude;
+	void *aView = mCacheView;
+	int j;
+
+	if(aView == NULL) {
+		return;
+	}
+
+	// A private copy of the map is made, so the file mapped by other processes is never changed.
+	mCacheView	= NULL;
+	mMapMemory	= NULL;
+	col			= NULL;
+	mLandMask	= NULL;
+	mPyramid	= NULL;
+	mAltitude	= NULL;
+	allocMap();
+
+	for(j = 0; j < Height; j++) {
+		memcpy(col[j], aCol[j], Width);
+	}
+	memcpy(mLandMask, aMask, mLandMaskWords * sizeof(unsigned long long));
+	memcpy(mPyramid, aPyramid, mPyramidOffset[mPyramidLevels + 1]);
+	if(mAltitude != NULL) {
+		memcpy(mAltitude, aAltitude, Width * Height * sizeof(float));
+	}
+
+	free(aCol);
+	unmapFile(aView, mCacheSize);
+}
+
+int CharackMapGenerator::exportMap(const char *thePath, int theFormat) {
+	CK_EXPORT_JOB *aJob;
+	int i, j;
+
+	if(col == NULL || thePath == NULL || strlen(thePath) >= CK_CACHE_PATH_MAX) {
+		return 0;
+	}
+
+	// Only one export at a time, the previous one must be finished before the next starts.
+	waitExport();
+
+	// The writer works with a copy of the map, so the generator can go on (and even generate a new map) meanwhile.
+	prepareTiles(0, 0, Width, Height);
+
+	aJob = (CK_EXPORT_JOB*)malloc(sizeof(CK_EXPORT_JOB));
+	if(aJob == NULL) {
+		return 0;
+	}
+
+	aJob->pixels = (unsigned char*)malloc(Width * Height);
+	if(aJob->pixels == NULL) {
+		free(aJob);
+		return 0;
+	}
+
+	strcpy(aJob->path, thePath);
+	aJob->format	= theFormat;
+	aJob->width		= Width;
+	aJob->height	= Height;
+
+	for(j = 0; j < Height; j++) {
+		memcpy(aJob->pixels + j * Width, col[j], Width);
+	}
+
+	for(i = 0; i < 256; i++) {
+		aJob->r[i] = rtable[i];
+		aJob->g[i] = gtable[i];
+		aJob->b[i] = btable[i];
+	}
+
+#ifdef _WIN32
+	mExportThread = CreateThread(NULL, 0, exportThread, aJob, 0, NULL);
+	mExporting = mExportThread != NULL;
+#else
+	mExporting = pthread_create(&mExportThread, NULL, exportThread, aJob) == 0;
+#endif
+
+	// If no thread could be created, the map is written right now.
+	if(!mExporting) {
+		exportThread(aJob);
+	}
+
+	return 1;
 }
 
-Vector3 CharackMapGenerator::findLineCorner(Vector3 theStart, int theDirection, int theGuideAxis) {
-	// TODO: the method
-	Vector3 aFake;
-	return aFake;
+void CharackMapGenerator::waitExport(void) {
+	if(!mExporting) {
+		return;
+	}
+
+#ifdef _WIN32
+	WaitForSingleObject(mExportThread, INFINITE);
+	CloseHandle(mExportThread);
+#else
+	pthread_join(mExportThread, NULL);
+#endif
+
+	mExporting = 0;
 }
 
-int CharackMapGenerator::inList(std::list<Vector3> theList, Vector3 theElement) {
-	std::list<Vector3>::iterator i;
-	int aReturn = 0;
+CK_THREAD_RESULT CharackMapGenerator::exportThread(void *theJob) {
+	CK_EXPORT_JOB *aJob = (CK_EXPORT_JOB*)theJob;
+	FILE *aFile;
+	int aOk;
 
-	for(i = theList.begin(); i != theList.end(); i++) {
-		Vector3 aElement = (*i);
-		if(aElement == theElement) {
-			aReturn = 1;
-			break;
+	aFile = fopen(aJob->path, "wb");
+
+	if(aFile == NULL) {
+		fprintf(stderr, "Could not open output file %s, error code = %d\n", aJob->path, errno);
+	} else {
+		setvbuf(aFile, NULL, _IOFBF, CK_EXPORT_BUFFER);
+
+		switch(aJob->format) {
+			case CK_EXPORT_BMP:	aOk = printbmp(aJob, aFile);	break;
+			case CK_EXPORT_PPM:	aOk = printppm(aJob, aFile);	break;
+			default:			aOk = printbmpBW(aJob, aFile);	break;
+		}
+
+		if(fclose(aFile) != 0 || !aOk) {
+			fprintf(stderr, "Could not write output file %s, error code = %d\n", aJob->path, errno);
 		}
 	}
-	return aReturn;
+
+	free(aJob->pixels);
+	free(aJob);
+
+	return 0;
 }
 
-Vector3 CharackMapGenerator::findCoast(int theMapX, int theMapZ, int theViewFrustum, int theSample) {
-	int aMapX, aMapZ, x, z;
-	Vector3 aLand;
+void CharackMapGenerator::setCacheDir(const char *theDir) {
+	mCacheDir[0] = '\0';
 
-	aMapX = theMapX;
-	aMapZ = theMapZ;
+	if(theDir != NULL && strlen(theDir) < CK_CACHE_PATH_MAX - 32) {
+		strcpy(mCacheDir, theDir);
+	}
+}
 
-	for(x = 0; x < theViewFrustum; x++, aMapX += theSample){ 
-		for(aMapZ = theMapZ, z = 0; z < theViewFrustum; z++, aMapZ += theSample){ 
-			if(globalIsLand(aMapX,aMapZ)) {
-				aLand.x = aMapX;
-				aLand.y = 0;
-				aLand.z = aMapZ;
+void CharackMapGenerator::setKeepAltitude(int theStatus) {
+	mKeepAltitude = theStatus;
+}
 
-				return aLand;
-			}
-		}
+int CharackMapGenerator::altitudeCoords(float theX, float theZ, int theBorder, int *i, int *j, float *theU, float *theV) {
+	float u, v;
+
+	if(mAltitude == NULL) {
+		return 0;
 	}
 
-	return aLand;
+	// Same conversion globalIsLand() does (the world X is the row and the world Z the column), but
+	// continuous, with the altitude of each pixel at its center.
+	v = (fmax_dov(0, fmin_dov(theX, CK_MAX_WIDTH)) / CK_MAX_WIDTH) * Height - 0.5f;
+	u = (fmax_dov(0, fmin_dov(theZ, CK_MAX_WIDTH)) / CK_MAX_WIDTH) * Width - 0.5f;
+
+	*i = (int)floor(u);
+	*j = (int)floor(v);
+	*theU = u - *i;
+	*theV = v - *j;
+
+	// The pixels [i-border+1, i+border] x [j-border+1, j+border] will be read.
+	prepareTiles(max_dov(*i - theBorder + 1, 0), max_dov(*j - theBorder + 1, 0), min_dov(*i + theBorder + 1, Width), min_dov(*j + theBorder + 1, Height));
+
+	return 1;
+}
+
+float CharackMapGenerator::altitudePixel(int i, int j) {
+	i = min_dov(max_dov(i, 0), Width - 1);
+	j = min_dov(max_dov(j, 0), Height - 1);
+
+	return mAltitude[j * Width + i];
+}
+
+float CharackMapGenerator::cubic(float p0, float p1, float p2, float p3, float t) {
+	// Catmull-Rom spline between p1 (t = 0) and p2 (t = 1).
+	return p1 + 0.5f * t * (p2 - p0 + t * (2.0f * p0 - 5.0f * p1 + 4.0f * p2 - p3 + t * (3.0f * (p1 - p2) + p3 - p0)));
+}
+
+float CharackMapGenerator::getAltitude(float theX, float theZ) {
+	float u, v;
+	int i, j;
+
+	if(!altitudeCoords(theX, theZ, 1, &i, &j, &u, &v)) {
+		return 0;
+	}
+
+	return	(1 - v) * ((1 - u) * altitudePixel(i, j)		+ u * altitudePixel(i + 1, j)) +
+				 v  * ((1 - u) * altitudePixel(i, j + 1)	+ u * altitudePixel(i + 1, j + 1)) - (float)mSeaLevel;
+}
+
+float CharackMapGenerator::getAltitudeCubic(float theX, float theZ) {
+	float u, v, aRows[4];
+	int i, j, k;
+
+	if(!altitudeCoords(theX, theZ, 2, &i, &j, &u, &v)) {
+		return 0;
+	}
+
+	for(k = 0; k < 4; k++) {
+		aRows[k] = cubic(altitudePixel(i - 1, j + k - 1), altitudePixel(i, j + k - 1), altitudePixel(i + 1, j + k - 1), altitudePixel(i + 2, j + k - 1), u);
+	}
+
+	return cubic(aRows[0], aRows[1], aRows[2], aRows[3], v) - (float)mSeaLevel;
+}
+
+void CharackMapGenerator::setOutline(int theMethod) {
+	mOutline = theMethod;
 }
 
-void CharackMapGenerator::updateCoastMap(std::list<Vector3> theCoastPoints) {
-	//TODO: the method...
+int CharackMapGenerator::setMacroSeaLevel(double theLevel) {
+	int i;
+
+	mNextSeaLevel = theLevel;
+
+	// Without the altitudes the new sea level is only used by the next generate(). The map (and the lazy tiles still
+	// to be generated) keep the old one, so the map is never a mix of both.
+	if(mAltitude == NULL) {
+		return 0;
+	}
+
+	mSeaLevel = theLevel;
+
+	detachCache();
+	mCoastDistanceReady = 0;
+	mContinentsReady = 0;
+	mCoastIndexReady = 0;
+
+	if(mTiles == NULL) {
+		rethreshold(0, 0, Width, Height);
+	} else {
+		for(i = 0; i < mTilesX * mTilesY; i++) {
+			if(mTiles[i]) {
+				rethreshold((i % mTilesX) * CK_MAP_TILE_SIZE, (i / mTilesX) * CK_MAP_TILE_SIZE, min_dov((i % mTilesX + 1) * CK_MAP_TILE_SIZE, Width), min_dov((i / mTilesX + 1) * CK_MAP_TILE_SIZE, Height));
+			}
+		}
+	}
+
+	return 1;
+}
+
+double CharackMapGenerator::getMacroSeaLevel(void) {
+	return mSeaLevel;
+}
+
+int CharackMapGenerator::popcount(unsigned long long theWord) {
+#ifdef __GNUC__
+	return __builtin_popcountll(theWord);
+#else
+	theWord = theWord - ((theWord >> 1) & 0x5555555555555555ULL);
+	theWord = (theWord & 0x3333333333333333ULL) + ((theWord >> 2) & 0x3333333333333333ULL);
+	theWord = (theWord + (theWord >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	return (int)((theWord * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+int CharackMapGenerator::lowestBit(unsigned long long theWord) {
+#ifdef __GNUC__
+	return __builtin_ctzll(theWord);
+#else
+	return popcount((theWord & (0 - theWord)) - 1);
+#endif
+}
+
+void CharackMapGenerator::packLandMask(int theX0, int theY0, int theX1, int theY1) {
+	unsigned long long aBit;
+	unsigned long aOffset;
+	int i, j;
+
+	for(j = theY0; j < theY1; j++) {
+		for(i = theX0; i < theX1; i++) {
+			aOffset = maskOffset(i, j);
+			aBit = 1ULL << (aOffset & 63);
+
+			if(col[j][i] == BLACK) {
+				mLandMask[aOffset >> 6] |= aBit;
+			} else {
+				mLandMask[aOffset >> 6] &= ~aBit;
+			}
+		}
+	}
+}
+
+void CharackMapGenerator::buildPyramid(int theX0, int theY0, int theX1, int theY1) {
+	unsigned char *aLevel, *aBelow;
+	double aSum, aArea, aCellArea;
+	int i, j, k, ci, cj, aKnown, aWidth, aHeight;
+
+	for(k = 1; k <= mPyramidLevels; k++) {
+		// The cells of level k that contain the region of level k-1.
+		theX0 >>= 1; theX1 = (theX1 + 1) >> 1;
+		theY0 >>= 1; theY1 = (theY1 + 1) >> 1;
+
+		aLevel	= mPyramid + mPyramidOffset[k];
+		aBelow	= mPyramid + mPyramidOffset[k - 1];
+		aWidth	= mPyramidWidth[k - 1];
+		aHeight	= mPyramidHeight[k - 1];
+
+		for(j = theY0; j < theY1; j++) {
+			for(i = theX0; i < theX1; i++) {
+				aSum = aArea = 0;
+				aKnown = 1;
+
+				// Each cell is the average of its (up to) 4 children, weighted by the pixels they cover.
+				for(cj = 2 * j; cj < 2 * j + 2 && cj < aHeight; cj++) {
+					for(ci = 2 * i; ci < 2 * i + 2 && ci < aWidth; ci++) {
+						if(k == 1) {
+							aSum += landBit(ci, cj) ? 254 : 0;
+							aArea += 1;
+						} else if(aBelow[cj * aWidth + ci] == CK_PYRAMID_UNKNOWN) {
+							aKnown = 0;
+						} else {
+							aCellArea = (double)(min_dov((ci + 1) << (k - 1), Width) - (ci << (k - 1))) * (min_dov((cj + 1) << (k - 1), Height) - (cj << (k - 1)));
+							aSum += aBelow[cj * aWidth + ci] * aCellArea;
+							aArea += aCellArea;
+						}
+					}
+				}
+
+				aLevel[j * mPyramidWidth[k] + i] = aKnown ? (unsigned char)(aSum / aArea + 0.5) : CK_PYRAMID_UNKNOWN;
+			}
+		}
+	}
+}
+
+float CharackMapGenerator::landFraction(float theX, float theZ, float theFootprint) {
+	int aX, aZ, k, aValue;
+	float aPixels;
+
+	if(theX < 0 || theX >= CK_MAX_WIDTH || theZ < 0 || theZ >= CK_MAX_WIDTH) {
+		return 0;
+	}
+
+	// The level whose cells are as big as the footprint: level k cells have 2^k x 2^k pixels.
+	aPixels = theFootprint / (float)(CK_MAX_WIDTH / Width);
+	for(k = 0; k < mPyramidLevels && (2 << k) <= aPixels; k++);
+
+	if(k == 0) {
+		return (float)globalIsLand(theX, theZ);
+	}
+
+	// Same conversion globalIsLand() does: the world X is the row and the world Z the column.
+	aX = min_dov((int)floor((theX/CK_MAX_WIDTH) * Width), Height - 1) >> k;
+	aZ = min_dov((int)floor((theZ/CK_MAX_WIDTH) * Height), Width - 1) >> k;
+
+	aValue = mPyramid[mPyramidOffset[k] + aX * mPyramidWidth[k] + aZ];
+
+	// In the lazy mode the cell is only known after the tiles below it are generated.
+	if(aValue == CK_PYRAMID_UNKNOWN) {
+		prepareTiles(aZ << k, aX << k, min_dov((aZ + 1) << k, Width), min_dov((aX + 1) << k, Height));
+		aValue = mPyramid[mPyramidOffset[k] + aX * mPyramidWidth[k] + aZ];
+	}
+
+	return aValue / 254.0f;
+}
+
+int CharackMapGenerator::hasContinentInside(float theX0, float theZ0, float theX1, float theZ1) {
+	int k, aRow0, aRow1, aCol0, aCol1;
+
+	// In the lazy mode the continents are not labelled just for this, it would generate the whole map.
+	if(mTiles != NULL && !loadReady(&mContinentsReady)) {
+		return 1;
+	}
+
+	if(getContinentCount() == 0 || theX1 < 0 || theX0 >= CK_MAX_WIDTH || theZ1 < 0 || theZ0 >= CK_MAX_WIDTH) {
+		return 0;
+	}
+
+	aRow0 = max_dov((int)floor((fmax_dov(theX0, 0) / CK_MAX_WIDTH) * Height), 0);
+	aRow1 = min_dov((int)floor((fmin_dov(theX1, CK_MAX_WIDTH) / CK_MAX_WIDTH) * Height), Height - 1);
+	aCol0 = max_dov((int)floor((fmax_dov(theZ0, 0) / CK_MAX_WIDTH) * Width), 0);
+	aCol1 = min_dov((int)floor((fmin_dov(theZ1, CK_MAX_WIDTH) / CK_MAX_WIDTH) * Width), Width - 1);
+
+	for(k = 0; k < mContinentCount; k++) {
+		if(mContinents[k].x0 <= aCol1 && mContinents[k].x1 >= aCol0 && mContinents[k].y0 <= aRow1 && mContinents[k].y1 >= aRow0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int CharackMapGenerator::continentAt(float theX, float theZ) {
+	int aX, aZ;
+
+	if(col == NULL || theX < 0 || theX >= CK_MAX_WIDTH || theZ < 0 || theZ >= CK_MAX_WIDTH) {
+		return 0;
+	}
+
+	buildOnce(&mContinentsReady, &CharackMapGenerator::labelContinents);
+
+	// Same conversion globalIsLand() does: the world X is the row and the world Z the column.
+	aX = min_dov((int)floor((theX / CK_MAX_WIDTH) * Height), Height - 1);
+	aZ = min_dov((int)floor((theZ / CK_MAX_WIDTH) * Width), Width - 1);
+
+	return mContinentId[aX * Width + aZ];
+}
+
+int CharackMapGenerator::findSpawnPoint(float *theX, float *theZ) {
+	const CK_CONTINENT *aBiggest = NULL;
+	int k, r, i, j, aRow, aCol, aCenterX, aCenterY;
+
+	if(col == NULL) {
+		return 0;
+	}
+
+	if(mTiles == NULL || loadReady(&mContinentsReady)) {
+		// The coast of the biggest continent.
+		for(k = 0; k < getContinentCount(); k++) {
+			if(aBiggest == NULL || mContinents[k].area > aBiggest->area) {
+				aBiggest = &mContinents[k];
+			}
+		}
+
+		if(aBiggest != NULL) {
+			pixelToWorld(aBiggest->coastX, aBiggest->coastY, theX, theZ);
+		}
+		return aBiggest != NULL;
+	}
+
+	// In the lazy mode the tiles are visited in rings around the center of the map, so only the tiles until the first
+	// one with land are generated.
+	aCenterX = mTilesX / 2;
+	aCenterY = mTilesY / 2;
+
+	for(r = 0; r <= max_dov(mTilesX, mTilesY); r++) {
+		for(j = aCenterY - r; j <= aCenterY + r; j++) {
+			for(i = aCenterX - r; i <= aCenterX + r; i++) {
+				if(i < 0 || j < 0 || i >= mTilesX || j >= mTilesY || (abs(i - aCenterX) != r && abs(j - aCenterY) != r)) {
+					continue;
+				}
+
+				for(aRow = j * CK_MAP_TILE_SIZE; aRow < min_dov((j + 1) * CK_MAP_TILE_SIZE, Height); aRow++) {
+					aCol = findLand(aRow, i * CK_MAP_TILE_SIZE, (i + 1) * CK_MAP_TILE_SIZE);
+
+					if(aCol >= 0) {
+						pixelToWorld(aCol, aRow, theX, theZ);
+						return 1;
+					}
+				}
+			}
+		}
+	}
+
+	return 0;
+}
+
+int CharackMapGenerator::getContinentCount(void) {
+	if(col != NULL) {
+		buildOnce(&mContinentsReady, &CharackMapGenerator::labelContinents);
+	}
+
+	return mContinentCount;
+}
+
+const CK_CONTINENT *CharackMapGenerator::getContinent(int theId) {
+	return theId >= 1 && theId <= getContinentCount() ? &mContinents[theId - 1] : NULL;
+}
+
+void CharackMapGenerator::pixelToWorld(int theMapX, int theMapY, float *theX, float *theZ) {
+	*theX = (float)((theMapY + 0.5) * CK_MAX_WIDTH / Height);
+	*theZ = (float)((theMapX + 0.5) * CK_MAX_WIDTH / Width);
+}
+
+float CharackMapGenerator::distanceToCoast(float theX, float theZ) {
+	int aX, aZ;
+
+	if(col == NULL) {
+		return 0;
+	}
+
+	buildOnce(&mCoastDistanceReady, &CharackMapGenerator::buildCoastDistance);
+
+	// Same conversion globalIsLand() does: the world X is the row and the world Z the column.
+	aX = min_dov(max_dov((int)floor((fmax_dov(0, fmin_dov(theX, CK_MAX_WIDTH)) / CK_MAX_WIDTH) * Height), 0), Height - 1);
+	aZ = min_dov(max_dov((int)floor((fmax_dov(0, fmin_dov(theZ, CK_MAX_WIDTH)) / CK_MAX_WIDTH) * Width), 0), Width - 1);
+
+	return mCoastDistance[aX * Width + aZ] * (float)(CK_MAX_WIDTH / Width);
+}
+
+int CharackMapGenerator::isLand(float theX, float theZ, float theFootprint) {
+	return landFraction(theX, theZ, theFootprint) >= 0.5f;
+}
+
+void CharackMapGenerator::prepareTiles(int theX0, int theY0, int theX1, int theY1) {
+	int i, j;
+
+	if(mTiles == NULL) {
+		return;
+	}
+
+	for(j = theY0 / CK_MAP_TILE_SIZE; j <= (theY1 - 1) / CK_MAP_TILE_SIZE; j++) {
+		for(i = theX0 / CK_MAP_TILE_SIZE; i <= (theX1 - 1) / CK_MAP_TILE_SIZE; i++) {
+			prepareTile(j * mTilesX + i);
+		}
+	}
+}
+
+// Generate a tile of the lazy map, unless it was already generated. If several threads ask for the same tile, one
+// of them generates it and the others wait.
+void CharackMapGenerator::prepareTile(int theTile) {
+	if(loadReady(&mTiles[theTile])) {
+		return;
+	}
+
+	lockBuild();
+	if(!mTiles[theTile]) {
+		mercatorTile(theTile);
+	}
+	unlockBuild();
+}
+
+// Call theBuild, which sets *theFlag once it is done, unless the flag says it was already called for the current map.
+// If several threads need the same build, one of them calls it and the others wait.
+void CharackMapGenerator::buildOnce(int *theFlag, void (CharackMapGenerator::*theBuild)(void)) {
+	if(loadReady(theFlag)) {
+		return;
+	}
+
+	lockBuild();
+	if(!*theFlag) {
+		(this->*theBuild)();
+	}
+	unlockBuild();
+}
+
+// Read a flag set by storeReady(). Whatever was written before the flag was set can be read once it says so.
+int CharackMapGenerator::loadReady(const int *theFlag) {
+#ifdef _WIN32
+	return *(const volatile int *)theFlag;	/* Visual C++ reads volatiles with acquire semantics */
+#else
+	return __atomic_load_n(theFlag, __ATOMIC_ACQUIRE);
+#endif
+}
+
+void CharackMapGenerator::storeReady(int *theFlag) {
+#ifdef _WIN32
+	*(volatile int *)theFlag = 1;			/* and writes them with release semantics */
+#else
+	__atomic_store_n(theFlag, 1, __ATOMIC_RELEASE);
+#endif
+}
+
+// The lock is recursive: a build can need another one (e.g. labelContinents() needs every tile).
+void CharackMapGenerator::lockBuild(void) {
+#ifdef _WIN32
+	EnterCriticalSection(&mBuildLock);
+#else
+	pthread_mutex_lock(&mBuildLock);
+#endif
+}
+
+void CharackMapGenerator::unlockBuild(void) {
+#ifdef _WIN32
+	LeaveCriticalSection(&mBuildLock);
+#else
+	pthread_mutex_unlock(&mBuildLock);
+#endif
+}
+
+int CharackMapGenerator::countLand(int theX0, int theY0, int theX1, int theY1) {
+	unsigned long long *aRow, aFirstMask, aLastMask;
+	int j, w, aFirstWord, aLastWord, aCount = 0;
+
+	theX0 = max_dov(theX0, 0); theX1 = min_dov(theX1, Width);
+	theY0 = max_dov(theY0, 0); theY1 = min_dov(theY1, Height);
+
+	if(mLandMask == NULL || theX0 >= theX1 || theY0 >= theY1) {
+		return 0;
+	}
+	prepareTiles(theX0, theY0, theX1, theY1);
+
+	// Whole words can only be counted at once if they are parts of rows.
+	if(mMaskLayout != CK_MASK_ROWS) {
+		for(j = theY0; j < theY1; j++) {
+			for(w = theX0; w < theX1; w++) {
+				aCount += landBit(w, j);
+			}
+		}
+		return aCount;
+	}
+
+	// Only the bits [theX0, theX1) of the first and last words are counted.
+	aFirstWord	= theX0 >> 6;
+	aLastWord	= (theX1 - 1) >> 6;
+	aFirstMask	= ~0ULL << (theX0 & 63);
+	aLastMask	= ~0ULL >> (63 - ((theX1 - 1) & 63));
+
+	for(j = theY0; j < theY1; j++) {
+		aRow = mLandMask + j * mLandMaskStride;
+
+		if(aFirstWord == aLastWord) {
+			aCount += popcount(aRow[aFirstWord] & aFirstMask & aLastMask);
+		} else {
+			aCount += popcount(aRow[aFirstWord] & aFirstMask);
+			for(w = aFirstWord + 1; w < aLastWord; w++) {
+				aCount += popcount(aRow[w]);
+			}
+			aCount += popcount(aRow[aLastWord] & aLastMask);
+		}
+	}
+
+	return aCount;
+}
+
+int CharackMapGenerator::findLand(int theRow, int theX0, int theX1) {
+	unsigned long long *aRow, aWord;
+	int w, aFirstWord, aLastWord;
+
+	theX0 = max_dov(theX0, 0); theX1 = min_dov(theX1, Width);
+
+	if(mLandMask == NULL || theRow < 0 || theRow >= Height || theX0 >= theX1) {
+		return -1;
+	}
+	prepareTiles(theX0, theRow, theX1, theRow + 1);
+
+	if(mMaskLayout != CK_MASK_ROWS) {
+		for(w = theX0; w < theX1; w++) {
+			if(landBit(w, theRow)) {
+				return w;
+			}
+		}
+		return -1;
+	}
+
+	aRow		= mLandMask + theRow * mLandMaskStride;
+	aFirstWord	= theX0 >> 6;
+	aLastWord	= (theX1 - 1) >> 6;
+
+	for(w = aFirstWord; w <= aLastWord; w++) {
+		aWord = aRow[w];
+
+		if(w == aFirstWord) {
+			aWord &= ~0ULL << (theX0 & 63);
+		}
+		if(w == aLastWord) {
+			aWord &= ~0ULL >> (63 - ((theX1 - 1) & 63));
+		}
+		if(aWord != 0) {
+			return (w << 6) + lowestBit(aWord);
+		}
+	}
+
+	return -1;
+}
+
+int CharackMapGenerator::planetBatch(const double *x, const double *y, const double *z, double *out, int n) {
+	CK_PLANET_CONTEXT *aContext = (CK_PLANET_CONTEXT *)calloc(1, sizeof(CK_PLANET_CONTEXT));
+	int i, k, aDepth;
+
+	if(aContext == NULL) {
+		return 0;
+	}
+
+	// The points of a group share the depth, so a group ends where the depth changes.
+	for(i = 0; i < n; i += k) {
+		aDepth = depthAt(y[i]);
+		for(k = 1; k < CK_MAP_BATCH && i + k < n && depthAt(y[i + k]) == aDepth; k++);
+
+		planetBatch(x + i, y + i, z + i, out + i, k, aDepth, aContext);
+	}
+
+	free(aContext);
+	return 1;
+}
+
+void CharackMapGenerator::setThreads(int theHowMany) {
+#ifdef _OPENMP
+	mThreads = theHowMany <= 0 ? omp_get_num_procs() : theHowMany;
+#else
+	(void)theHowMany;
+	mThreads = 1;
+#endif
+}
+
+int CharackMapGenerator::getThreads() {
+	return mThreads;
+}
+
+void CharackMapGenerator::setNodeCache(int theStep, int theWays) {
+	mNodeCacheStep	= theStep < 0 ? 0 : theStep;
+	mNodeCacheWays	= theWays < 1 ? 1 : (theWays > CK_NODE_CACHE_MAX_WAYS ? CK_NODE_CACHE_MAX_WAYS : theWays);
+
+	// The path to a node must fit in an unsigned int (one bit per level).
+	mNodeCacheDepths = mNodeCacheStep == 0 ? 0 : min_dov(CK_NODE_CACHE_MAX_DEPTHS, 31 / mNodeCacheStep);
+}
+
+void CharackMapGenerator::setCoherent(int theStatus) {
+	mCoherent = theStatus;
+}
+
+void CharackMapGenerator::setLandMaskOnly(int theStatus) {
+	mLandMaskOnly = theStatus;
+}
+
+void CharackMapGenerator::setEdgeTable(int theBits) {
+	freeEdgeTables();
+	mEdgeTableBits = theBits;
+}
+
+void CharackMapGenerator::setLazy(int theStatus) {
+	mLazy = theStatus;
+}
+
+void CharackMapGenerator::printDebugInfo(void) {
+	unsigned long aEdgeLookups = 0, aEdgeHits = 0;
+	int i;
+
+	for(i = 0; i < mEdgeTableCount; i++) {
+		aEdgeLookups += mEdgeTables[i].lookups;
+		aEdgeHits += mEdgeTables[i].hits;
+	}
+
+	printf("--- Charack Map Generator (Debug info) ---\n\n");
+	printf("Map size = %dx%d\n", Width, Height);
+	printf("Threads = %d\n", getThreads());
+	printf("Descent = %.2f levels per point (%s)\n", mDescentPoints ? (double)mDescentLevels / mDescentPoints : 0.0, mCoherent ? "coherent" : "node cache");
+	printf("Depth reached = %.2f levels per point (%s)\n", mDescentPoints ? (double)mDescentDepths / mDescentPoints : 0.0, mSignOnly ? "land mask only" : "full depth");
+	printf("Edge table = %d entries per thread, %.2f%% hits\n", mEdgeTableBits ? 1 << mEdgeTableBits : 0, aEdgeLookups ? 100.0 * aEdgeHits / aEdgeLookups : 0.0);
+	if(mCacheDir[0] != '\0') {
+		printf("Cache = %s (%s)\n", mCacheHit ? "hit" : "miss", mCachePath);
+	}
+	if(mTiles != NULL) {
+		printf("Lazy map = %lu of %d tiles generated\n", mTilesGenerated, mTilesX * mTilesY);
+	}
+	printf("Altitude = %s, sea level = %.4f\n", mAltitude != NULL ? "kept" : "not kept", mSeaLevel);
+	printf("Node cache: step = %d, depths = %d, ways = %d\n", mNodeCacheStep, mNodeCacheDepths, mNodeCacheWays);
+
+	for(i = 0; i < mNodeCacheDepths; i++) {
+		printf("\t depth %2d: %5.2f%% hits\n", (i+1) * mNodeCacheStep, mNodeCacheLookups ? 100.0 * mNodeCacheHits[i] / mNodeCacheLookups : 0.0);
+	}
+}
+
+int CharackMapGenerator::isLand(float theX, float theZ) {
+	// TODO: the method. For now, we use the information of a macro world view.
+	return globalIsLand(theX, theZ);
+}
+
+
+
+void CharackMapGenerator::clearCoastMap() {
+	int x;
+
+	// Only the words touched since the last clean up are cleared.
+	if(mCoastMap != NULL && mCoastDirtyX0 <= mCoastDirtyX1) {
+		for(x = mCoastDirtyX0; x <= mCoastDirtyX1; x++) {
+			memset(mCoastMap + x * mCoastMapWords + (mCoastDirtyZ0 >> 6), 0, ((mCoastDirtyZ1 >> 6) - (mCoastDirtyZ0 >> 6) + 1) * sizeof(unsigned long long));
+		}
+	}
+
+	mCoastDirtyX0 = mCoastDirtyZ0 = 0x7fffffff;
+	mCoastDirtyX1 = mCoastDirtyZ1 = -1;
+}
+
+void CharackMapGenerator::allocCoastMap(int theViewFrustum) {
+	if(mCoastMap != NULL && mCoastMapSize == theViewFrustum) {
+		return;
+	}
+
+	free(mCoastMap);
+	mCoastMapSize	= theViewFrustum;
+	mCoastMapWords	= (theViewFrustum + 63) / 64;
+	mCoastMap		= (unsigned long long*)calloc(mCoastMapSize * mCoastMapWords, sizeof(unsigned long long));
+
+	mCoastDirtyX0 = mCoastDirtyZ0 = 0x7fffffff;
+	mCoastDirtyX1 = mCoastDirtyZ1 = -1;
+}
+
+void CharackMapGenerator::markCoast(int theX, int theZ) {
+	if(theX < 0 || theX >= mCoastMapSize || theZ < 0 || theZ >= mCoastMapSize) {
+		return;
+	}
+
+	mCoastMap[theX * mCoastMapWords + (theZ >> 6)] |= 1ULL << (theZ & 63);
+
+	mCoastDirtyX0 = theX < mCoastDirtyX0 ? theX : mCoastDirtyX0;
+	mCoastDirtyX1 = theX > mCoastDirtyX1 ? theX : mCoastDirtyX1;
+	mCoastDirtyZ0 = theZ < mCoastDirtyZ0 ? theZ : mCoastDirtyZ0;
+	mCoastDirtyZ1 = theZ > mCoastDirtyZ1 ? theZ : mCoastDirtyZ1;
+}
+
+int CharackMapGenerator::isCoast(float theX, float theZ) {
+	int x, z;
+
+	if(mCoastMap == NULL) {
+		return 0;
+	}
+
+	x = (int)floor((theX - mCoastMapX) / mCoastMapSample + 0.5);
+	z = (int)floor((theZ - mCoastMapZ) / mCoastMapSample + 0.5);
+
+	if(x < 0 || x >= mCoastMapSize || z < 0 || z >= mCoastMapSize) {
+		return 0;
+	}
+
+	return (int)((mCoastMap[x * mCoastMapWords + (z >> 6)] >> (z & 63)) & 1);
+}
+
+void CharackMapGenerator::applyCoast(int theMapX, int theMapZ, int theViewFrustum, int theSample) {
+	CharackSegmentIndex *aIndex;
+	const float *s;
+	int k, v;
+
+	// First of all, we clean up the coast map. Its cells are the samples of the view.
+	allocCoastMap(theViewFrustum);
+	clearCoastMap();
+	mCoastMapX		= theMapX;
+	mCoastMapZ		= theMapZ;
+	mCoastMapSample	= theSample;
+
+	aIndex = getCoastIndex();
+
+	if(aIndex != NULL) {
+		// Only the segments of the macro coast that cross the view.
+		aIndex->query((float)theMapX, (float)theMapZ, (float)theMapX + (float)(theViewFrustum - 1) * theSample, (float)theMapZ + (float)(theViewFrustum - 1) * theSample, &mCoastSegments);
+
+		for(k = 0; k < (int)mCoastSegments.size(); k++) {
+			s = aIndex->getSegment(mCoastSegments[k]);
+			applyCoastSegment(s, s + 2);
+		}
+	} else {
+		// In the lazy mode, while the map is not complete, the lines come from the samples of the view.
+		findCoastLines(theMapX, theMapZ, theViewFrustum, theSample, &mCoastLines);
+
+		for(k = 0; k + 1 < (int)mCoastLines.starts.size(); k++) {
+			for(v = mCoastLines.starts[k]; v < mCoastLines.starts[k + 1]; v++) {
+				applyCoastSegment(&mCoastLines.points[2 * v], &mCoastLines.points[2 * (v + 1 < mCoastLines.starts[k + 1] ? v + 1 : mCoastLines.starts[k])]);
+			}
+		}
+	}
+}
+
+void CharackMapGenerator::applyCoastSegment(const float *a, const float *b) {
+	std::list<Vector3> aNewCoastPoints;
+
+	// Apply the midpoint displacement algorithm to create a noised line, which looks pretty much the same as a
+	// real coast line. The noise goes across the segment: along X if it goes along Z, and vice versa.
+	aNewCoastPoints = getCoastGenerator().generate(Vector3(a[0], 0, a[1]), Vector3(b[0], 0, b[1]), fabs(b[1] - a[1]) >= fabs(b[0] - a[0]) ? CharackCoastGenerator::AXIS_X : CharackCoastGenerator::AXIS_Z);
+
+	// Now that we know the points of the new coast, we have to apply them to the coast
+	// map (and, as a consequence, create the lines among the points). In the end, the
+	// coast map will give us the information isLand() needs to tell anyone what is
+	// water and what is land.
+	updateCoastMap(aNewCoastPoints);
+}
+
+CharackSegmentIndex *CharackMapGenerator::getCoastIndex() {
+	if(col != NULL && !loadReady(&mCoastIndexReady)) {
+		lockBuild();
+		if(!mCoastIndexReady && (mTiles == NULL || mTilesGenerated == (unsigned long)(mTilesX * mTilesY))) {
+			buildCoastIndex();
+		}
+		unlockBuild();
+	}
+
+	return loadReady(&mCoastIndexReady) ? &mCoastIndex : NULL;
+}
+
+// The coast lines of the whole macro map (the samples are the centers of the pixels), cut into their sides and put
+// in mCoastIndex.
+void CharackMapGenerator::buildCoastIndex(void) {
+	CK_COAST_LINES aLines;
+	int i, j, k, v, w;
+
+	prepareTiles(0, 0, Width, Height);
+	allocCoastCells(Height, Width);
+
+	for(j = 0; j < Height; j++) {
+		for(i = 0; i < Width; i++) {
+			if(col[j][i] == BLACK) {
+				mCoastCells[(j + 1) * (Width + 2) + i + 1] = 16;
+			}
+		}
+	}
+
+	traceCoastLines(Height, Width, (float)(0.5 * CK_MAX_WIDTH / Height), (float)(0.5 * CK_MAX_WIDTH / Width), (float)(CK_MAX_WIDTH / Height), (float)(CK_MAX_WIDTH / Width), &aLines);
+
+	mCoastIndex.clear();
+
+	for(k = 0; k + 1 < (int)aLines.starts.size(); k++) {
+		for(v = aLines.starts[k]; v < aLines.starts[k + 1]; v++) {
+			w = v + 1 < aLines.starts[k + 1] ? v + 1 : aLines.starts[k];
+			mCoastIndex.addSegment(aLines.points[2 * v], aLines.points[2 * v + 1], aLines.points[2 * w], aLines.points[2 * w + 1]);
+		}
+	}
+
+	mCoastIndex.build(0, 0, (float)CK_MAX_WIDTH, (float)CK_MAX_WIDTH, (float)(CK_COAST_INDEX_CELL * CK_MAX_WIDTH / Height));
+	storeReady(&mCoastIndexReady);
+}
+
+void CharackMapGenerator::allocCoastCells(int theRows, int theCols) {
+	int aSize = (theRows + 2) * (theCols + 2);
+
+	if(mCoastCellsSize < aSize) {
+		free(mCoastCells);
+		mCoastCellsSize = aSize;
+		mCoastCells = (unsigned char*)malloc(mCoastCellsSize);
+	}
+	memset(mCoastCells, 0, aSize);
+}
+
+// Marching squares over the samples of the view: the samples are the corners of the cells, and the coast crosses the
+// sides of a cell whose corners are one land and the other water, at their middle. The window is surrounded by one
+// row/column of water, so every line is closed. Each cell keeps, in mCoastCells, if its sample (the top left corner)
+// is land (bit 4) and which of its sides were already visited (bits 0-3: top, right, bottom, left). The lines are
+// followed cell by cell and every side is visited once, so the whole thing is linear in the size of the window.
+void CharackMapGenerator::findCoastLines(int theMapX, int theMapZ, int theViewFrustum, int theSample, CK_COAST_LINES *theLines) {
+	int r, c;
+
+	// If no continent is inside the view, there is no coast to find.
+	if(!hasContinentInside((float)theMapX, (float)theMapZ, (float)theMapX + (float)(theViewFrustum - 1) * theSample, (float)theMapZ + (float)(theViewFrustum - 1) * theSample)) {
+		theLines->points.clear();
+		theLines->starts.assign(1, 0);
+		return;
+	}
+
+	allocCoastCells(theViewFrustum, theViewFrustum);
+
+	// The samples: the cell (r,c) of the window is mCoastCells[(r+1)*(theViewFrustum+2) + c+1].
+	for(r = 0; r < theViewFrustum; r++) {
+		for(c = 0; c < theViewFrustum; c++) {
+			if(globalIsLand((float)(theMapX + r * theSample), (float)(theMapZ + c * theSample))) {
+				mCoastCells[(r + 1) * (theViewFrustum + 2) + c + 1] = 16;
+			}
+		}
+	}
+
+	traceCoastLines(theViewFrustum, theViewFrustum, (float)theMapX, (float)theMapZ, (float)theSample, (float)theSample, theLines);
+}
+
+// Follow the lines of the samples in mCoastCells (theRows x theCols, plus the border of water). The sample (r,c) is at
+// the world position (theX + r*theStepX, theZ + c*theStepZ).
+void CharackMapGenerator::traceCoastLines(int theRows, int theCols, float theX, float theZ, float theStepX, float theStepZ, CK_COAST_LINES *theLines) {
+	static const int aNextRow[4] = {-1, 0, 1, 0}, aNextCol[4] = {0, 1, 0, -1};
+	int aSize = theCols + 2, r, c, e, f, k, v, aCount;
+	int *aVertex;
+	unsigned char *aCell;
+
+	theLines->points.clear();
+	theLines->starts.assign(1, 0);
+
+	for(r = -1; r < theRows; r++) {
+		for(c = -1; c < theCols; c++) {
+			for(e = 0; e < 4; e++) {
+				aCell = mCoastCells + (r + 1) * aSize + c + 1;
+				if(!coastCrosses(aCell, aSize, e) || (*aCell & (1 << e))) {
+					continue;
+				}
+
+				// A new line, starting at the middle of the side e of the cell (r,c). A side is shared by two cells, so
+				// it is marked in both of them.
+				mCoastVertices.clear();
+				k = r; v = c; f = e;
+				*aCell |= 1 << e;
+				aCell[aNextRow[e] * aSize + aNextCol[e]] |= 1 << ((e + 2) & 3);
+
+				do {
+					f = coastPartner(aCell, aSize, f);
+					*aCell |= 1 << f;
+					aCell[aNextRow[f] * aSize + aNextCol[f]] |= 1 << ((f + 2) & 3);
+					addCoastVertex(2 * k + 1 + aNextRow[f], 2 * v + 1 + aNextCol[f]);
+
+					// Go to the cell on the other side of f, entering it by the opposite side.
+					k += aNextRow[f];
+					v += aNextCol[f];
+					f = (f + 2) & 3;
+					aCell = mCoastCells + (k + 1) * aSize + v + 1;
+				} while(k != r || v != c || f != e);
+
+				// The line is closed: the last and the first vertices may be in the middle of a straight run too.
+				for(aCount = (int)mCoastVertices.size() / 2; aCount > 3; aCount--) {
+					aVertex = &mCoastVertices[mCoastVertices.size() - 2];
+					if(collinear(aVertex - 2, aVertex, &mCoastVertices[0])) {
+						mCoastVertices.resize(mCoastVertices.size() - 2);
+					} else if(collinear(aVertex, &mCoastVertices[0], &mCoastVertices[2])) {
+						mCoastVertices.erase(mCoastVertices.begin(), mCoastVertices.begin() + 2);
+					} else {
+						break;
+					}
+				}
+
+				for(aVertex = &mCoastVertices[0]; aVertex < &mCoastVertices[0] + mCoastVertices.size(); aVertex += 2) {
+					theLines->points.push_back(theX + aVertex[0] * 0.5f * theStepX);
+					theLines->points.push_back(theZ + aVertex[1] * 0.5f * theStepZ);
+				}
+				theLines->starts.push_back((int)theLines->points.size() / 2);
+			}
+		}
+	}
+}
+
+// If the coast crosses the side theSide of the cell theCell, i.e. the corners of that side are one land and the other water.
+int CharackMapGenerator::coastCrosses(unsigned char *theCell, int theRowSize, int theSide) {
+	int aCorners = coastCorners(theCell, theRowSize);
+	return ((aCorners >> theSide) ^ (aCorners >> ((theSide + 1) & 3))) & 1;
+}
+
+// The corners of a cell that are land: bit 0 is the top left one, then top right, bottom right and bottom left, so the
+// side k of the cell goes from the corner k to the corner k+1.
+int CharackMapGenerator::coastCorners(unsigned char *theCell, int theRowSize) {
+	return (theCell[0] >> 4) | (theCell[1] >> 4) << 1 | (theCell[theRowSize + 1] >> 4) << 2 | (theCell[theRowSize] >> 4) << 3;
+}
+
+// The other side of the cell the coast that crosses theSide goes out by. When the coast crosses all the sides (the land
+// corners are opposite), the land corners are taken as connected, like the continents (8 neighbours), so the coast
+// turns around the water corners.
+int CharackMapGenerator::coastPartner(unsigned char *theCell, int theRowSize, int theSide) {
+	int aCorners = coastCorners(theCell, theRowSize), aOther;
+
+	if(aCorners == 5 || aCorners == 10) {
+		// The side k touches the corners k and k+1: the line turns around the one of them that is water.
+		return (aCorners >> theSide) & 1 ? (theSide + 1) & 3 : (theSide + 3) & 3;
+	}
+
+	for(aOther = (theSide + 1) & 3; !coastCrosses(theCell, theRowSize, aOther); aOther = (aOther + 1) & 3);
+	return aOther;
+}
+
+int CharackMapGenerator::collinear(int *theA, int *theB, int *theC) {
+	return (theB[0] - theA[0]) * (theC[1] - theB[1]) == (theB[1] - theA[1]) * (theC[0] - theB[0]);
+}
+
+// Add a vertex to the line being followed in findCoastLines(). The vertices are kept as twice their position in the
+// window, so the middle of the sides of the cells are integers; a vertex in the middle of a straight run is removed.
+void CharackMapGenerator::addCoastVertex(int theRow, int theCol) {
+	int aSize = (int)mCoastVertices.size();
+
+	if(aSize >= 4) {
+		int aVertex[2] = {theRow, theCol};
+
+		if(collinear(&mCoastVertices[aSize - 4], &mCoastVertices[aSize - 2], aVertex)) {
+			mCoastVertices[aSize - 2] = theRow;
+			mCoastVertices[aSize - 1] = theCol;
+			return;
+		}
+	}
+
+	mCoastVertices.push_back(theRow);
+	mCoastVertices.push_back(theCol);
+}
+
+Vector3 CharackMapGenerator::findCoast(int theMapX, int theMapZ, int theViewFrustum, int theSample) {
+	int aMapX, aMapZ, x, z;
+	Vector3 aLand;
+
+	aMapX = theMapX;
+	aMapZ = theMapZ;
+
+	// If no continent is inside the view, there is no coast to find.
+	if(!hasContinentInside((float)theMapX, (float)theMapZ, (float)theMapX + (float)(theViewFrustum - 1) * theSample, (float)theMapZ + (float)(theViewFrustum - 1) * theSample)) {
+		return aLand;
+	}
+
+	for(x = 0; x < theViewFrustum; x++, aMapX += theSample){ 
+		for(aMapZ = theMapZ, z = 0; z < theViewFrustum; z++, aMapZ += theSample){ 
+			if(globalIsLand(aMapX,aMapZ)) {
+				aLand.x = aMapX;
+				aLand.y = 0;
+				aLand.z = aMapZ;
+
+				return aLand;
+			}
+		}
+	}
+
+	return aLand;
+}
+
+void CharackMapGenerator::updateCoastMap(const std::list<Vector3> &theCoastPoints) {
+	std::list<Vector3>::const_iterator i;
+	double ax = 0, az = 0, bx, bz;
+	int k, aSteps;
+
+	// Every cell between two consecutive points is marked (the points are close, so the line among them is straight).
+	for(i = theCoastPoints.begin(); i != theCoastPoints.end(); i++) {
+		bx = (i->x - mCoastMapX) / mCoastMapSample;
+		bz = (i->z - mCoastMapZ) / mCoastMapSample;
+
+		if(i == theCoastPoints.begin()) {
+			ax = bx;
+			az = bz;
+		}
+
+		aSteps = (int)ceil(fmax_dov(fabs(bx - ax), fabs(bz - az)));
+		for(k = 0; k <= aSteps; k++) {
+			markCoast((int)floor(ax + (aSteps ? (bx - ax) * k / aSteps : 0) + 0.5), (int)floor(az + (aSteps ? (bz - az) * k / aSteps : 0) + 0.5));
+		}
+
+		ax = bx;
+		az = bz;
+	}
 }
 
 CharackCoastGenerator CharackMapGenerator::getCoastGenerator() {
@@ -2,15 +2,39 @@
 #define __CHARACK_MAP_GENERATOR_H_
 
 #include <stdio.h>
+#include <vector>
 #include <errno.h>
 #include <math.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 #include <stdio.h>
 
+#ifdef _WIN32
+	#include <windows.h>
+	#define CK_THREAD_RESULT DWORD WINAPI
+#else
+	#include <pthread.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/stat.h>
+	#include <sys/mman.h>
+	#define CK_THREAD_RESULT void*
+#endif
+
+#ifdef _OPENMP
+	#include <omp.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define CK_SSE2
+	#include <emmintrin.h>
+#endif
+
 #include "config.h"
 #include "CharackCoastGenerator.h"
 #include "CharackLineSegment.h"
+#include "CharackSegmentIndex.h"
 #include "vector3.h"
 
 #define BLACK 0
@@ -21,6 +45,135 @@
 
 #define MAXCOL	10
 typedef int CTable[MAXCOL][3];
+
+// A vertex of the planet subdivision: coordinates, altitude and seed.
+typedef struct {
+	double x, y, z;
+	double alt;
+	double seed;
+} CK_VERTEX;
+
+// A tetrahedron of the planet subdivision (vertices a, b, c and d, in that order).
+typedef struct {
+	CK_VERTEX v[4];
+} CK_TETRAHEDRON;
+
+// Max number of depths and entries per depth of the subdivision node cache.
+#define CK_NODE_CACHE_MAX_DEPTHS	8
+#define CK_NODE_CACHE_MAX_WAYS		8
+
+// A node of the planet subdivision. It is identified by its depth and by the path taken from the
+// root tetrahedron to reach it (one bit per level, 1 meaning the side of vertex a was taken).
+typedef struct {
+	CK_TETRAHEDRON tetra;
+	unsigned int path;
+	unsigned int stamp; /* when the node was last used, 0 means an empty entry */
+} CK_NODE;
+
+// Subdivision nodes stored by planet() and reused by planet1() when a new point falls inside one of them,
+// so the descent resumes from the deepest cached ancestor instead of the root tetrahedron. Nodes are kept at
+// the depths step, 2*step, ... (counted from the root), with a few entries per depth replaced in LRU order.
+typedef struct {
+	CK_NODE nodes[CK_NODE_CACHE_MAX_DEPTHS][CK_NODE_CACHE_MAX_WAYS];
+	unsigned int clock;
+	unsigned long lookups;
+	unsigned long hits[CK_NODE_CACHE_MAX_DEPTHS];
+} CK_NODE_CACHE;
+
+// Max depth of the subdivision kept by CK_PATH_STACK.
+#define CK_PATH_MAX_DEPTH			64
+
+// Every node (tetrahedron) of the last descent made by planet(), from the root (tetra[0]) to the deepest one.
+// Consecutive points of a scanline share almost the whole path, so the next descent pops nodes until the
+// tetrahedron contains the new point and goes down from there.
+typedef struct {
+	CK_TETRAHEDRON tetra[CK_PATH_MAX_DEPTH];
+	int size;
+} CK_PATH_STACK;
+
+// The midpoint of an edge split by planet(). It only depends on the two vertices of the edge, so neighbouring
+// tetrahedra and neighbouring pixels can share it. Seeds are not unique (the first split of the root tetrahedron
+// already repeats one), so each vertex is identified by its seed and its x, with (s1,x1) < (s2,x2).
+typedef struct {
+	double s1, x1, s2, x2;
+	double x, y, z, alt, seed;
+	double lp;				/* pow(lab,POW) of the edge */
+} CK_EDGE;
+
+// A direct-mapped table of 2^bits edge midpoints, where a new edge replaces the one in its slot.
+typedef struct {
+	CK_EDGE *edges;
+	unsigned long lookups;
+	unsigned long hits;
+} CK_EDGE_TABLE;
+
+// Everything planet() needs to remember between two points. Each thread running mercator() has its own context.
+typedef struct {
+	CK_NODE_CACHE nodes;
+	CK_PATH_STACK path;
+	CK_EDGE_TABLE *edges;	/* edge midpoints of the thread, or NULL */
+	unsigned long points;	/* how many points were evaluated */
+	unsigned long levels;	/* how many levels were descended to evaluate them */
+	unsigned long depths;	/* sum of the depths where the points were decided */
+} CK_PLANET_CONTEXT;
+
+// A group of points of a batch (one bit per point in mask) that still share the same tetrahedron.
+typedef struct {
+	CK_TETRAHEDRON tetra;
+	int depth;
+	int level;
+	unsigned int path;
+	unsigned int mask;
+} CK_BATCH_GROUP;
+
+// The parameters a cached macro map was generated with (see CharackMapGenerator::setCacheDir()).
+typedef struct {
+	double rseed, M, dd1, dd2, POW;
+	double longi, lat, scale;
+	double seaLevel;
+	int width, height;
+	int maskLayout;
+	int altitude;
+} CK_MAP_CACHE_KEY;
+
+// The header of a cache file. It is followed by the map (stride bytes per row), the land mask, the land pyramid and the
+// altitude (if the key says it was kept), each one at its offset from the beginning of the file.
+typedef struct {
+	char magic[8];
+	unsigned int version;
+	CK_MAP_CACHE_KEY key;
+	int stride;
+	int maskWords;
+	int pyramidBytes;
+	unsigned long long mapOffset, maskOffset, pyramidOffset, altitudeOffset;
+	unsigned long long size;	/* of the whole file */
+} CK_MAP_CACHE_HEADER;
+
+// A continent of the macro map: a group of connected land pixels (see CharackMapGenerator::getContinent()).
+// X is the column and Y the row of the map.
+typedef struct {
+	int id;
+	int x0, y0, x1, y1;		/* bounds (inclusive) */
+	int area;				/* pixels */
+	double cx, cy;			/* centroid */
+	int coastX, coastY;		/* the first pixel with water on a side (the first pixel if there is no water) */
+} CK_CONTINENT;
+
+// Coast lines found by CharackMapGenerator::findCoastLines(). The vertices (world X and Z) of all the lines are one
+// after the other in points, and the line k is made of the vertices starts[k] to starts[k+1]-1.
+typedef struct {
+	std::vector<float> points;
+	std::vector<int> starts;
+} CK_COAST_LINES;
+
+// A copy of the macro map (and of its palette) being written to a file by CharackMapGenerator::exportMap().
+typedef struct {
+	char path[CK_CACHE_PATH_MAX];
+	int format;
+	int width, height;
+	unsigned char *pixels;	/* the colour of pixel (i,j) is pixels[j*width+i] */
+	int r[256], g[256], b[256];
+} CK_EXPORT_JOB;
     
 #ifndef PI
 	#define PI 3.14159265358979
@@ -42,17 +195,35 @@ typedef int CTable[MAXCOL][3];
  * This class uses the continent generation algorithm by Torben AE. Mogensen <torbenm@diku.dk>. The original code
  * was downloaded from http://www.diku.dk/hjemmesider/ansatte/torbenm/, I just removed the code Charack will not
  * need and encapsulated the rest all togheter inside a class.
+ *
+ * Every instance keeps its own state (palette, subdivision caches, etc), so several generators can
+ * run generate() at the same time in different threads. The queries of one generator (globalIsLand(),
+ * isLand(), continentAt(), distanceToCoast(), etc) can also be called by several threads at the same
+ * time: what they build on demand (the tiles of the lazy map, the continents, the distance to the coast
+ * and the coast index) is built once, by one of them, while the others wait.
  */
 class CharackMapGenerator {
 	private:
 		CharackCoastGenerator mCoastGen;
-		int mCoastMap[CK_VIEW_FRUSTUM][CK_VIEW_FRUSTUM];
+		unsigned long long *mCoastMap;			/* one bit per sample of the view: cell (x,z) is bit z%64 of mCoastMap[x*mCoastMapWords + z/64] */
+		int mCoastMapSize;						/* view frustum the coast map was allocated for */
+		int mCoastMapWords;						/* words per row of mCoastMap */
+		int mCoastMapX, mCoastMapZ, mCoastMapSample;	/* world position of the cell (0,0) and distance between cells */
+		int mCoastDirtyX0, mCoastDirtyZ0, mCoastDirtyX1, mCoastDirtyZ1;	/* cells marked since the last clearCoastMap() */
+		CK_COAST_LINES mCoastLines;				/* the coast lines of the last applyCoast() */
+		unsigned char *mCoastCells;				/* samples and visited sides of findCoastLines() */
+		int mCoastCellsSize;
+		std::vector<int> mCoastVertices;		/* the line findCoastLines() is following */
+		CharackSegmentIndex mCoastIndex;		/* the sides of the coast lines of the whole macro map */
+		int mCoastIndexReady;					/* if mCoastIndex belongs to the current map */
+		std::vector<int> mCoastSegments;		/* the segments of mCoastIndex in the view of the last applyCoast() */
 
 		int altColors;
 		int BLUE1, LAND0, LAND1, LAND2, LAND4;
 		int GREEN1, BROWN0, GREY0;
 		int back;
 		int nocols;
+		CTable colors, alt_colors;
 		int rtable[256], gtable[256], btable[256];
 		int lighter; /* specifies lighter colours */
 		double M;   /* initial altitude (slightly below sea level) */
@@ -70,13 +241,37 @@ class CharackMapGenerator {
 		int Width;
 		int Height;
 
-		unsigned char **col;
+		unsigned char **col;		/* the rows of the map: the colour of pixel (i,j) is col[j][i] */
+		unsigned char *mMap;		/* the map itself, all rows together (aligned to CK_MAP_ALIGN bytes) */
+		unsigned char *mMapMemory;	/* the memory block where mMap is */
+		int mMapStride;				/* bytes between two rows of the map */
+		int mMapWidth, mMapHeight;	/* size of the map that was allocated */
+		unsigned long long *mLandMask;	/* one bit per pixel of the map (1 = land), in the order given by mMaskLayout */
+		int mLandMaskStride;			/* words between two rows of the land mask (depends on the layout) */
+		int mLandMaskWords;
+		int mMaskLayout;				/* CK_MASK_ROWS, CK_MASK_COLUMNS or CK_MASK_MORTON */
+		unsigned char *mPyramid;		/* land fraction (0 to 254) of the levels 1..mPyramidLevels, level k at mPyramidOffset[k] */
+		int mPyramidLevels;
+		int mPyramidOffset[CK_PYRAMID_MAX_LEVELS + 2];
+		int mPyramidWidth[CK_PYRAMID_MAX_LEVELS + 2];
+		int mPyramidHeight[CK_PYRAMID_MAX_LEVELS + 2];
+		float *mAltitude;				/* the altitude of pixel (i,j) is mAltitude[j*Width+i] (NULL if it is not kept) */
+		int mKeepAltitude;				/* if the next map will keep mAltitude */
+		float *mCoastDistance;			/* signed distance (pixels) from pixel (i,j) to the coast at mCoastDistance[j*Width+i] */
+		int mCoastDistanceReady;		/* if mCoastDistance belongs to the current map */
+		int *mContinentId;				/* continent of pixel (i,j) at mContinentId[j*Width+i] (0 = water) */
+		CK_CONTINENT *mContinents;		/* the continent with id k is mContinents[k-1] */
+		int mContinentCount;
+		int mContinentCapacity;
+		int mContinentsReady;			/* if mContinentId and mContinents belong to the current map */
+		double mSeaLevel;				/* altitude of the sea level of the macro map */
+		double mNextSeaLevel;			/* sea level set by setMacroSeaLevel(), used by the next generate() */
+		int mOutline;					/* CK_OUTLINE_BITS or CK_OUTLINE_BYTES */
 		int **heights;
 		int cl0[60][30];
 
 		int do_outline;
 		int do_bw;
-		int *outx, *outy;
 
 		double cla, sla, clo, slo;
 
@@ -86,19 +281,124 @@ class CharackMapGenerator {
 		int best;
 		int weight[30];
 
+		int mThreads; /* how many threads mercator() will use */
+
+		int mNodeCacheStep;		/* levels between two cached depths of the subdivision */
+		int mNodeCacheDepths;	/* how many depths are cached */
+		int mNodeCacheWays;		/* how many nodes are cached per depth */
+		unsigned long mNodeCacheLookups;
+		unsigned long mNodeCacheHits[CK_NODE_CACHE_MAX_DEPTHS];
+
+		int mCoherent;			/* if the scanline coherent descent (CK_PATH_STACK) is used instead of the node cache */
+		unsigned long mDescentPoints;
+		unsigned long mDescentLevels;
+		unsigned long mDescentDepths;
+
+		int mLandMaskOnly;		/* if only the land/water information is needed, not the exact altitude */
+		int mSignOnly;			/* if planet() can stop as soon as the sign of the altitude is known */
+
+		int mEdgeTableBits;		/* each edge table has 2^bits entries (0 = no table) */
+		int mEdgeTableCount;	/* one table per thread */
+		CK_EDGE_TABLE *mEdgeTables;
+
+		int mLazy;				/* if the map is generated tile by tile, when globalIsLand() needs it */
+		int *mTiles;			/* if each tile of the lazy map was already generated (NULL if the map is not lazy) */
+		int mTilesX, mTilesY;
+		unsigned long mTilesGenerated;
+		int mMapShift;			/* vertical shift of the rows, from lat */
+#ifdef _WIN32
+		CRITICAL_SECTION mBuildLock;	/* held while a query builds something on demand (see buildOnce()) */
+#else
+		pthread_mutex_t mBuildLock;
+#endif
+
+		char mCacheDir[CK_CACHE_PATH_MAX];	/* where generated maps are cached ("" = no cache) */
+		char mCachePath[CK_CACHE_PATH_MAX];	/* the cache file of the last generated map */
+		void *mCacheView;		/* the cache file mapped in memory, if the map came from it (NULL otherwise) */
+		size_t mCacheSize;
+		int mCacheHit;			/* if the last map came from the cache */
+
+#ifdef _WIN32
+		HANDLE mExportThread;
+#else
+		pthread_t mExportThread;
+#endif
+		int mExporting;			/* if mExportThread is writing a map */
+
 		int min_dov(int x, int y);
 		int max_dov(int x, int y);
 		double fmin_dov(double x, double y);
 		double fmax_dov(double x, double y);
 		void setcolours();
-		void makeoutline(int do_bw);
 		void mercator();
-		int planet0(double x, double y, double z);
-		double planet(double a,double b,double c,double d, double as, double bs, double cs, double ds, double ax, double ay, double az, double bx, double by, double bz, double cx, double cy, double cz, double dx, double dy, double dz, double x, double y, double z, int level);
-		double planet1(double x, double y, double z);
+		void allocMap(void);
+		void freeMap(void);
+		void sizePyramid(void);
+		void allocLandMask(void);
+		void sizeLandMask(void);
+		void packLandMask(int theX0, int theY0, int theX1, int theY1);
+		unsigned int morton(int theX, int theY);
+		unsigned long maskOffset(int i, int j);
+		int landBit(int i, int j);
+		unsigned long long cacheKey(CK_MAP_CACHE_KEY *theKey);
+		int loadCache(void);
+		void saveCache(void);
+		void detachCache(void);
+		void *mapFile(const char *thePath, size_t *theSize);
+		void unmapFile(void *theView, size_t theSize);
+		int altitudeCoords(float theX, float theZ, int theBorder, int *i, int *j, float *theU, float *theV);
+		float altitudePixel(int i, int j);
+		float cubic(float p0, float p1, float p2, float p3, float t);
+		void prepareTiles(int theX0, int theY0, int theX1, int theY1);
+		void prepareTile(int theTile);
+		void buildOnce(int *theFlag, void (CharackMapGenerator::*theBuild)(void));
+		int loadReady(const int *theFlag);
+		void storeReady(int *theFlag);
+		void lockBuild(void);
+		void unlockBuild(void);
+		void buildPyramid(int theX0, int theY0, int theX1, int theY1);
+		int popcount(unsigned long long theWord);
+		int lowestBit(unsigned long long theWord);
+		void mercatorInit();
+		void mercatorRows(int theFirstRow, int theLastRow, int theFirstCol, int theLastCol, int theShift, unsigned char *theOut);
+		void mercatorTile(int theTile);
+		int depthAt(double y);
+		void mercatorRow(int theRow, int theShift, double *y, double *cos2, int *theDepth);
+		void distance1D(const double *f, int n, double *d, int *v, double *z);
+		void distanceTransform(int theLand, double *theOut);
+		void buildCoastDistance(void);
+		int findLabel(int *theParent, int theLabel);
+		void unionLabels(int *theParent, int a, int b);
+		void labelContinents(void);
+		int hasContinentInside(float theX0, float theZ0, float theX1, float theZ1);
+		void outlineTile(const unsigned char *theRaw, int theStride, int ax0, int ay0, int ax1, int ay1, int x0, int y0, int x1, int y1);
+		void outlineBits(const unsigned char *theRaw, int theStride, int ax0, int ay0, int ax1, int ay1, int x0, int y0, int x1, int y1);
+		void outlineBytes(const unsigned char *theRaw, int theStride, int ax0, int ay0, int ax1, int ay1, int x0, int y0, int x1, int y1);
+		void packColours(const unsigned char *theRaw, int n, unsigned long long *theLand, unsigned long long *theSolid);
+		unsigned long long wordAt(const unsigned long long *theRow, int theBit);
+		void thresholdRow(int theRow, int theFirstCol, int theLastCol, double theLevel, unsigned char *theOut);
+		void rethreshold(int x0, int y0, int x1, int y1);
+		CK_EDGE_TABLE *edgeTable(void);
+		void clearEdgeTables(void);
+		void freeEdgeTables(void);
+		const CK_EDGE *edgemidpoint(const CK_VERTEX *a, const CK_VERTEX *b, double lab, CK_PLANET_CONTEXT *theContext, CK_EDGE *theSpare);
+		int planet0(double x, double y, double z, int theDepth, CK_PLANET_CONTEXT *theContext);
+		int altcolour(double alt, double y);
+		double planet(const CK_TETRAHEDRON *theTetra, int theTetraDepth, unsigned int thePath, double x, double y, double z, int level, CK_PLANET_CONTEXT *theContext);
+		double planet1(double x, double y, double z, int theDepth, CK_PLANET_CONTEXT *theContext);
+		void planetBatch(const double *x, const double *y, const double *z, double *out, int n, int theDepth, CK_PLANET_CONTEXT *theContext);
+		unsigned int sideMask(const double *x, const double *y, const double *z, int n, unsigned int theMask, double ex, double ey, double ez, const CK_VERTEX *c, const CK_VERTEX *d, double theSide);
+		void roottetrahedron(CK_TETRAHEDRON *theTetra);
+		int signdecided(const CK_VERTEX *a, const CK_VERTEX *b, const CK_VERTEX *c, const CK_VERTEX *d, int level, double theEdge, double *theAlt);
+		const CK_TETRAHEDRON *startnode(const double *x, const double *y, const double *z, int n, int theDepth, CK_PLANET_CONTEXT *theContext, int *theNodeDepth, unsigned int *thePath);
+		int isInsideTetrahedron(const CK_TETRAHEDRON *theTetra, double x, double y, double z);
+		void cacheNode(CK_NODE_CACHE *theCache, int theIndex, const CK_VERTEX *a, const CK_VERTEX *b, const CK_VERTEX *c, const CK_VERTEX *d, unsigned int thePath);
 		double rand2(double p, double q);
-		void printbmp(FILE *outfile);
-		void printbmpBW(FILE *outfile);
+		static CK_THREAD_RESULT exportThread(void *theJob);
+		static void putint(unsigned char *out, int value, int bytes);
+		static int printppm(const CK_EXPORT_JOB *job, FILE *outfile);
+		static int printbmp(const CK_EXPORT_JOB *job, FILE *outfile);
+		static int printbmpBW(const CK_EXPORT_JOB *job, FILE *outfile);
 		double log_2(double x);
 
 		// Globaly check if a specific position is land or water. The test is made against the macro world information,
@@ -109,56 +409,35 @@ class CharackMapGenerator {
 
 		// Clean up all the information in the coast map. After this method invocation, every call
 		// to isLand() will return false until applyCoast() is called (which will regenerate the land/water info).
+		// Only the rectangle marked since the last call is cleared.
 		void clearCoastMap();
 
-		// Find all coast lines visible on the screen.
-		std::list<CharackLineSegment> findCoastLines(int theMapX, int theMapZ, int theViewFrustum, int theSample);
+		// Allocate the coast map for a view of theViewFrustum x theViewFrustum samples (if it is not that size already).
+		void allocCoastMap(int theViewFrustum);
+
+		// Mark the cell (theX,theZ) of the coast map as coast.
+		void markCoast(int theX, int theZ);
+
+		// Find all coast lines visible on the screen: the lines between the land and the water samples of the view, whose
+		// corners are theMapX + i*theSample, theMapZ + j*theSample (0 <= i,j < theViewFrustum). The lines are closed (the
+		// view is taken as surrounded by water) and their vertices are in the middle of two samples.
+		void findCoastLines(int theMapX, int theMapZ, int theViewFrustum, int theSample, CK_COAST_LINES *theLines);
+		void traceCoastLines(int theRows, int theCols, float theX, float theZ, float theStepX, float theStepZ, CK_COAST_LINES *theLines);
+		void allocCoastCells(int theRows, int theCols);
+		void buildCoastIndex(void);
+		void applyCoastSegment(const float *a, const float *b);
+		int coastCrosses(unsigned char *theCell, int theRowSize, int theSide);
+		int coastCorners(unsigned char *theCell, int theRowSize);
+		int coastPartner(unsigned char *theCell, int theRowSize, int theSide);
+		int collinear(int *theA, int *theB, int *theC);
+		void addCoastVertex(int theRow, int theCol);
 
 		// Apply all the cost point to the coast map, creating the lines among the points.
-		void updateCoastMap(std::list<Vector3> theCoastPoints);
-
-		// Starting in thePoint, this method will "walk" over the line thePoint belongs to, adding all found corners
-		// to theCorners. To avoid walk over the lines already visited, the third parameter "theDirection" will guide
-		// the movement direction. e.g: if the method is walkin in a vertical line, when a corner is found, the method
-		// will switch the moviment direction to a horizontal one. When another corner is found on the horizontal line,
-		// the moviment direction will be switched to vertical again, and so on.
-		void findCorners(std::list<Vector3> theCorners, Vector3 thePoint, int theDirection, int theListInsertOrder);
-		
-		// Checks if theElement is in theList.
-		int inList(std::list<Vector3> theList, Vector3 theElement);
+		void updateCoastMap(const std::list<Vector3> &theCoastPoints);
 
 		// Find a point that belongs to a coast line. The method will return the firt cost point found.
 		Vector3 findCoast(int theMapX, int theMapZ, int theViewFrustum, int theSample);
 
-		// Checks if a point is a corner or not.
-		int isCorner(Vector3 thePoint);
-
-		// Starting in theStart, the method will walk over the line thePoint belongs to until it finds the
-		// corner at the end of the line. The param theGuideAxis tells which axis the method must use
-		// to walk over. theDirection tells the direction in the axis, e.g: theGuieAxis=X, theDirection=RIGHT means
-		// "walk over z axis of theStart, walking to the right, until you find a corver".
-		//
-		// theStart must belongs to a coast line.
-		Vector3 findLineCorner(Vector3 theStart, int theDirection, int theGuideAxis);
-
-		// thePoint must be a corner; the method will check if, starting with thePoint, is there a possibility
-		// to "walk" down in a line. e.g:
-		// 
-		//   A --------
-		//   |  land  |
-		//   |        | 
-		//   B --------
-		//      water
-		//
-		// If thePoint is B, canGoDown() will return false. If thePoint is A, canGoDown() will return true.
-		int canGoDown(Vector3 thePoint);
-
-		// The same as canGoDown(), but checking left/right instead of up/down.
-		int canGoLeft(Vector3 thePoint);
-
-		// Checks if thePoint is inside the user view frustum.
-		int isInsideViewFrustum(Vector3 thePoint);
-
 		CharackCoastGenerator getCoastGenerator(void);
 
 	public:
@@ -180,15 +459,154 @@ class CharackMapGenerator {
 		CharackMapGenerator();
 		~CharackMapGenerator();
 
-		// Generate the world (land and water)
+		// Generate the world (land and water). No file is written, see exportMap().
 		void generate();
+
+		// Define how many threads generate() will use to create the macro map. The map is split into bands of
+		// CK_MAP_BAND_ROWS rows that are shared among the threads. If theHowMany is 0, one thread per core is used.
+		// The generated map is the same no matter how many threads are used.
+		void setThreads(int theHowMany);
+		int getThreads();
+
+		// Configure the subdivision node cache used while generating the map. Nodes are cached every theStep levels
+		// of the subdivision (at most CK_NODE_CACHE_MAX_DEPTHS depths) and theWays nodes are kept for each cached depth.
+		// A step of 0 disables the cache. The generated map is the same no matter how the cache is configured.
+		void setNodeCache(int theStep, int theWays);
+
+		// Enable or disable the scanline coherent descent. When enabled, the generator remembers the whole subdivision path
+		// of the previous point and only pops the levels that do not contain the next point, instead of using the node cache.
+		// The generated map is the same in both modes.
+		void setCoherent(int theStatus);
+
+		// Enable or disable the land mask only mode. In this mode the subdivision stops as soon as it is known if a point is above
+		// or below the sea level, so the map has the right land/water information but not the exact colour of each point.
+		// It is only used with the default palette (no altColors, no latic), otherwise the full depth is always used.
+		void setLandMaskOnly(int theStatus);
+
+		// Set the size of the edge midpoint tables: every thread of mercator() remembers the last 2^theBits edges split
+		// by planet(), using 80*2^theBits bytes. A value of 0 disables the tables. The generated map is always the same.
+		void setEdgeTable(int theBits);
+
+		// Enable or disable the lazy map. When enabled, generate() returns almost immediately and the map is split in tiles of
+		// CK_MAP_TILE_SIZE pixels, each one generated the first time globalIsLand() uses it. The lazy map is the same the
+		// row by row generation makes. Each tile is generated once, even if several threads ask for it at the same time.
+		// The default (CK_MAP_LAZY) is on.
+		void setLazy(int theStatus);
+
+
+		// Choose how the pixels of the land mask are ordered in memory: CK_MASK_ROWS (row by row, the default and the only
+		// layout where countLand() and findLand() work with whole words), CK_MASK_COLUMNS (column by column) or CK_MASK_MORTON
+		// (tiles of 64x64 pixels in Z-order, so each word is a block of 8x8 pixels).
+		void setMaskLayout(int theLayout);
+
+		// Measure globalIsLand() with every layout of the land mask, using the loops of CharackWorld::generateMap() with
+		// several samples, and print the results.
+		void benchmarkMaskLayouts(int theViewFrustum);
+
+		// Keep (1) or not (0) the altitude of every pixel of the next generated map, so getAltitude() and getAltitudeCubic() can
+		// read it. The altitudes are exact, so the map is always generated at full depth.
+		void setKeepAltitude(int theStatus);
+
+		// Altitude of the macro map at a position of the world above the sea level of the map (so it follows setMacroSeaLevel()),
+		// interpolated between the pixels around it: bilinear (getAltitude()) or bicubic (getAltitudeCubic()). Returns 0 if the
+		// altitude was not kept.
+		float getAltitude(float theX, float theZ);
+		float getAltitudeCubic(float theX, float theZ);
+
+		// Choose how the outline of the map (land and the water next to it are black, the rest of the water is white) is found:
+		// CK_OUTLINE_BITS dilates the land one bit per pixel, 64 pixels per word, and CK_OUTLINE_BYTES one byte per pixel with
+		// SSE2. Both make the same map.
+		void setOutline(int theMethod);
+
+		// Move the sea level of the macro map to theLevel (0 is the sea level of the generated planet). If the altitude is kept
+		// (see setKeepAltitude()), the map, its land mask and its land pyramid are calculated again right away from the altitudes,
+		// without generating the planet, and 1 is returned. Otherwise the level is only used by the next generate() (the current map,
+		// including the tiles of a lazy map not generated yet, keeps the old level) and 0 is returned.
+		int setMacroSeaLevel(double theLevel);
+
+		// The sea level the current map was made with. A level set by setMacroSeaLevel() without the altitude kept only
+		// shows up here after the next generate().
+		double getMacroSeaLevel(void);
+
+		// Keep the generated maps in theDir ("" or NULL disables the cache). Each map is a file named after a hash of the
+		// parameters it was generated with. If the file exists, generate() maps it in memory (read only) instead of
+		// generating the map, so several processes using the same map share its pages. Otherwise the map is generated and
+		// written to the file. Lazy maps are never written, but they are read from the cache like the others.
+		void setCacheDir(const char *theDir);
+
+		// Write the macro map to thePath in the background: theFormat is CK_EXPORT_BMP_BW (land and water in black and white),
+		// CK_EXPORT_BMP or CK_EXPORT_PPM (in the colours of the palette). The map is copied before the method returns, so it can
+		// be changed (or generated again) while the file is written. Only one map is written at a time, so a new export waits
+		// for the previous one. Returns 0 if there is no map to export.
+		int exportMap(const char *thePath, int theFormat);
+
+		// Wait until the map being exported by exportMap(), if any, is completely written.
+		void waitExport(void);
+
+		// Calculate the altitude of the n points (x[i], y[i], z[i]) of the unit sphere, storing them in out. Each point is
+		// subdivided as deep as mercator() goes at its latitude, so the points of a pixel center get the altitude of the map.
+		// Groups of up to CK_MAP_BATCH points descend the subdivision together until they fall into different tetrahedra. In the
+		// coherent mode (CK_MAP_COHERENT, the default) a group starts where the descent of its first point leaves the one of
+		// the previous point, otherwise from the node cache, so neighbouring points given in order share the top of their
+		// descents. Must be called after generate(). Returns 0 if there is not enough memory.
+		int planetBatch(const double *x, const double *y, const double *z, double *out, int n);
+
+		// Print useful information about the last generated map.
+		void printDebugInfo(void);
 		
 		// Check if a specific position is land or water. 
-		int isLand(float theX, float theZ);		
+		int isLand(float theX, float theZ);
+
+		// The continent (1 to getContinentCount()) at a position of the world, or 0 if it is water. Continents are the groups of
+		// connected land pixels of the macro map; they are labelled by the first call after the map changed (which in the lazy
+		// mode needs the whole map).
+		int continentAt(float theX, float theZ);
+		int getContinentCount(void);
+
+		// Bounds, area, centroid and a coast pixel of the continent theId, or NULL if there is no such continent.
+		const CK_CONTINENT *getContinent(int theId);
+
+		// A position on land to place an observer: the coast of the biggest continent or, in the lazy mode (unless the
+		// continents were already labelled), the first land pixel found visiting the tiles from the center of the map
+		// outward, so the map is not generated just for this. Returns 0 if there is no land.
+		int findSpawnPoint(float *theX, float *theZ);
+
+		// The position of the world at the center of the pixel (theMapX, theMapY) of the macro map.
+		void pixelToWorld(int theMapX, int theMapY, float *theX, float *theZ);
+
+		// Distance (world units) from a position of the world to the closest coast of the macro map: positive on land and
+		// negative on water. It comes from an exact Euclidean distance transform of the land mask, made by the first call after
+		// the map changed (in the lazy mode it needs the whole map), so the following calls are O(1).
+		float distanceToCoast(float theX, float theZ);
+
+		// Same as isLand(), but for a sample covering theFootprint x theFootprint of the world (e.g. the sample of
+		// CharackWorld): it is land if at least half of the macro map pixels around the position are land.
+		int isLand(float theX, float theZ, float theFootprint);
+
+		// Fraction (0 to 1) of land around a position of the world, for a sample covering theFootprint x theFootprint.
+		// The answer comes from the level of the land pyramid whose cells are as big as the footprint, so coarse samples
+		// only touch a small level. Fractions are exact to within 1/254 per level.
+		float landFraction(float theX, float theZ, float theFootprint);		
+
+		// Count the land pixels of the macro map inside the rectangle [theX0,theX1) x [theY0,theY1), where X is the
+		// column and Y the row of the map (globalIsLand() maps the world Z to the column and the world X to the row).
+		int countLand(int theX0, int theY0, int theX1, int theY1);
+
+		// Find the first land pixel of the row theRow of the macro map whose column is in [theX0,theX1). Returns
+		// its column or -1 if all of them are water.
+		int findLand(int theRow, int theX0, int theX1);
 
 		// This method will find all coast lines (which are straight lines before the method call) and, for each one,
 		// generate a much more real coast line, adding some noise to the lines.
 		void applyCoast(int theMapX, int theMapZ, int theViewFrustum, int theSample);
+
+		// The index of the coast segments of the whole macro map (in world coordinates), which applyCoast() uses to find
+		// the segments in the view. It is built by the first call after the map changed. Returns NULL
+		// in the lazy mode while some tiles of the map were not generated.
+		CharackSegmentIndex *getCoastIndex(void);
+
+		// If the sample of the view closest to a position of the world is on the coast found by the last applyCoast().
+		int isCoast(float theX, float theZ);
 };
 
 #endif
\ No newline at end of file
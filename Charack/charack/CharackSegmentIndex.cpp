@@ -0,0 +1,165 @@
+#include "CharackSegmentIndex.h"
+
+CharackSegmentIndex::CharackSegmentIndex() {
+	mQuery = 0;
+	mX0 = mZ0 = 0;
+	mCellSize = 1;
+	mCellsX = mCellsZ = 0;
+}
+
+CharackSegmentIndex::~CharackSegmentIndex() {
+}
+
+void CharackSegmentIndex::clear() {
+	mSegments.clear();
+	mCellStart.clear();
+	mCellSegments.clear();
+	mStamp.clear();
+	mCellsX = mCellsZ = 0;
+}
+
+void CharackSegmentIndex::addSegment(float theX0, float theZ0, float theX1, float theZ1) {
+	mSegments.push_back(theX0);
+	mSegments.push_back(theZ0);
+	mSegments.push_back(theX1);
+	mSegments.push_back(theZ1);
+}
+
+void CharackSegmentIndex::build(float theX0, float theZ0, float theX1, float theZ1, float theCellSize) {
+	int aCount = getSegmentCount(), i, x, z, aCX0, aCZ0, aCX1, aCZ1;
+
+	mX0 = theX0;
+	mZ0 = theZ0;
+	mCellSize = theCellSize;
+	// The far sides belong to the area too, so they get cells of their own.
+	mCellsX = (int)floor((theX1 - theX0) / theCellSize) + 1;
+	mCellsZ = (int)floor((theZ1 - theZ0) / theCellSize) + 1;
+
+	// Two passes over the segments: count how many go in each cell, then put them there.
+	mCellStart.assign(mCellsX * mCellsZ + 1, 0);
+
+	for(i = 0; i < aCount; i++) {
+		if(segmentCells(i, &aCX0, &aCZ0, &aCX1, &aCZ1)) {
+			for(x = aCX0; x <= aCX1; x++) {
+				for(z = aCZ0; z <= aCZ1; z++) {
+					mCellStart[x * mCellsZ + z + 1]++;
+				}
+			}
+		}
+	}
+
+	for(i = 0; i < mCellsX * mCellsZ; i++) {
+		mCellStart[i + 1] += mCellStart[i];
+	}
+
+	mCellSegments.resize(mCellStart[mCellsX * mCellsZ]);
+
+	for(i = 0; i < aCount; i++) {
+		if(segmentCells(i, &aCX0, &aCZ0, &aCX1, &aCZ1)) {
+			for(x = aCX0; x <= aCX1; x++) {
+				for(z = aCZ0; z <= aCZ1; z++) {
+					mCellSegments[mCellStart[x * mCellsZ + z]++] = i;
+				}
+			}
+		}
+	}
+
+	// The fill moved every start to the start of the next cell.
+	for(i = mCellsX * mCellsZ; i > 0; i--) {
+		mCellStart[i] = mCellStart[i - 1];
+	}
+	mCellStart[0] = 0;
+
+	mStamp.assign(aCount, 0);
+	mQuery = 0;
+}
+
+void CharackSegmentIndex::query(float theX0, float theZ0, float theX1, float theZ1, std::vector<int> *theResult) {
+	int x, z, k, aId, aCX0, aCZ0, aCX1, aCZ1;
+
+	theResult->clear();
+
+	if(!cellRange(theX0, theZ0, theX1, theZ1, &aCX0, &aCZ0, &aCX1, &aCZ1)) {
+		return;
+	}
+
+	// A new stamp for this query; when they wrap around, the old ones must go.
+	if(++mQuery == 0) {
+		mStamp.assign(mStamp.size(), 0);
+		mQuery = 1;
+	}
+
+	for(x = aCX0; x <= aCX1; x++) {
+		for(z = aCZ0; z <= aCZ1; z++) {
+			for(k = mCellStart[x * mCellsZ + z]; k < mCellStart[x * mCellsZ + z + 1]; k++) {
+				aId = mCellSegments[k];
+
+				if(mStamp[aId] != mQuery) {
+					mStamp[aId] = mQuery;
+
+					if(crosses(getSegment(aId), theX0, theZ0, theX1, theZ1)) {
+						theResult->push_back(aId);
+					}
+				}
+			}
+		}
+	}
+}
+
+int CharackSegmentIndex::getSegmentCount() {
+	return (int)mSegments.size() / 4;
+}
+
+const float *CharackSegmentIndex::getSegment(int theId) {
+	return &mSegments[4 * theId];
+}
+
+int CharackSegmentIndex::cellRange(float theX0, float theZ0, float theX1, float theZ1, int *theCX0, int *theCZ0, int *theCX1, int *theCZ1) {
+	*theCX0 = (int)floor((theX0 - mX0) / mCellSize);
+	*theCZ0 = (int)floor((theZ0 - mZ0) / mCellSize);
+	*theCX1 = (int)floor((theX1 - mX0) / mCellSize);
+	*theCZ1 = (int)floor((theZ1 - mZ0) / mCellSize);
+
+	if(*theCX1 < 0 || *theCZ1 < 0 || *theCX0 >= mCellsX || *theCZ0 >= mCellsZ) {
+		return 0;
+	}
+
+	*theCX0 = *theCX0 < 0 ? 0 : *theCX0;
+	*theCZ0 = *theCZ0 < 0 ? 0 : *theCZ0;
+	*theCX1 = *theCX1 >= mCellsX ? mCellsX - 1 : *theCX1;
+	*theCZ1 = *theCZ1 >= mCellsZ ? mCellsZ - 1 : *theCZ1;
+
+	return 1;
+}
+
+int CharackSegmentIndex::segmentCells(int theId, int *theCX0, int *theCZ0, int *theCX1, int *theCZ1) {
+	const float *s = getSegment(theId);
+
+	return cellRange(s[0] < s[2] ? s[0] : s[2], s[1] < s[3] ? s[1] : s[3], s[0] < s[2] ? s[2] : s[0], s[1] < s[3] ? s[3] : s[1], theCX0, theCZ0, theCX1, theCZ1);
+}
+
+// Liang-Barsky: clip the segment against the four sides of the rectangle and see if anything is left.
+int CharackSegmentIndex::crosses(const float *theSegment, float theX0, float theZ0, float theX1, float theZ1) {
+	double aDX = theSegment[2] - theSegment[0], aDZ = theSegment[3] - theSegment[1];
+	double p[4] = {-aDX, aDX, -aDZ, aDZ};
+	double q[4] = {theSegment[0] - theX0, theX1 - theSegment[0], theSegment[1] - theZ0, theZ1 - theSegment[1]};
+	double aIn = 0, aOut = 1, t;
+	int i;
+
+	for(i = 0; i < 4; i++) {
+		if(p[i] == 0) {
+			if(q[i] < 0) {
+				return 0;
+			}
+		} else {
+			t = q[i] / p[i];
+			if(p[i] < 0) {
+				aIn = t > aIn ? t : aIn;
+			} else {
+				aOut = t < aOut ? t : aOut;
+			}
+		}
+	}
+
+	return aIn <= aOut;
+}
\ No newline at end of file
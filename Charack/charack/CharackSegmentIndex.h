@@ -0,0 +1,63 @@
+#ifndef __CHARACK_SEGMENT_INDEX_H_
+#define __CHARACK_SEGMENT_INDEX_H_
+
+#include <stdlib.h>
+#include <math.h>
+#include <vector>
+
+#include "config.h"
+
+/**
+ * A uniform grid over a set of line segments on the ground (X,Z), to find the segments that cross a rectangle
+ * without looking at all of them. CharackMapGenerator keeps one with the coast of the macro map, but the class knows
+ * nothing about coasts: anything that needs the segments around a position (the coast detailer, a line of sight
+ * test, etc) can use it.
+ *
+ * Usage: addSegment() for every segment, then build(); query() can be called any number of times after that.
+ */
+class CharackSegmentIndex {
+	private:
+		std::vector<float> mSegments;			/* x0,z0,x1,z1 of every segment */
+		std::vector<int> mCellStart;			/* the cell k has mCellSegments[mCellStart[k]] to mCellSegments[mCellStart[k+1]-1] */
+		std::vector<int> mCellSegments;
+		std::vector<unsigned int> mStamp;		/* the last query that found each segment, so it is reported once */
+		unsigned int mQuery;
+
+		float mX0, mZ0;
+		float mCellSize;
+		int mCellsX, mCellsZ;
+
+		// The cells covered by [theX0,theX1]x[theZ0,theZ1], clamped to the grid. Returns 0 if there is none.
+		int cellRange(float theX0, float theZ0, float theX1, float theZ1, int *theCX0, int *theCZ0, int *theCX1, int *theCZ1);
+
+		// The cells covered by the bounding box of the segment theId.
+		int segmentCells(int theId, int *theCX0, int *theCZ0, int *theCX1, int *theCZ1);
+
+		// If the segment theSegment crosses (or is inside) the rectangle [theX0,theX1]x[theZ0,theZ1].
+		int crosses(const float *theSegment, float theX0, float theZ0, float theX1, float theZ1);
+
+	public:
+		CharackSegmentIndex();
+		~CharackSegmentIndex();
+
+		// Remove all the segments.
+		void clear();
+
+		// Add a segment. It is only found by query() after the next build().
+		void addSegment(float theX0, float theZ0, float theX1, float theZ1);
+
+		// Sort the segments into a grid covering [theX0,theX1]x[theZ0,theZ1] with cells of theCellSize x theCellSize.
+		// Segments (or parts of them) outside that area are never found.
+		void build(float theX0, float theZ0, float theX1, float theZ1, float theCellSize);
+
+		// Put in theResult the ids of the segments crossing the rectangle [theX0,theX1]x[theZ0,theZ1], each one once.
+		// The cost is the number of cells of the rectangle plus the number of segments in them.
+		void query(float theX0, float theZ0, float theX1, float theZ1, std::vector<int> *theResult);
+
+		int getSegmentCount();
+
+		// The segment theId: its ends are (x0,z0) and (x1,z1), in that order.
+		const float *getSegment(int theId);
+};
+
+#endif
\ No newline at end of file
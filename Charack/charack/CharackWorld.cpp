@@ -55,7 +55,7 @@ void CharackWorld::generateMap(void) {
 
 	for(aMapX = abs(aXNow) - (getViewFrustum()/2) * getSample(), x = 0; x < getViewFrustum(); x++, aMapX+=getSample()){ 
 		for(aMapZ = abs(aZNow) - (getViewFrustum()/2) * getSample(), z = 0; z < getViewFrustum(); z++, aMapZ+=getSample()){ 
-			if(getMapGenerator()->isLand(aMapX,aMapZ)) {
+			if(getMapGenerator()->isLand(aMapX,aMapZ,getSample())) {
 				mMap[x][z] = Vector3(aMapX, getHeight(aMapX, aMapZ) * normilizeHeight(), aMapZ, 1);
 			} else {
 				mMap[x][z] = Vector3(aMapX, CK_SEA_LEVEL, aMapZ, 0);
@@ -180,16 +180,16 @@ void CharackWorld::printDebugInfo(void) {
 	printf("\t View frustum: c,v\n");
 	printf("\t Sampling: n,m\n");
 	printf("\t Scale: k,l\n");
+	printf("\t Macro sea level: h,j (the first change generates the macro map again)\n");
+	printf("\t Benchmark map layouts: b\n");
+	printf("\t Save the macro map: o\n");
 }
 
 void CharackWorld::placeObserverOnLand() {
-	for(int z=0; z < CK_MAX_WIDTH; z++) {
-		for(int x=0; x < CK_MAX_WIDTH; x++) {
-			if(getMapGenerator()->isLand(x, z)) {
-				getObserver()->setPosition(-x, getObserver()->getPositionY(), -z);
-				return;
-			}
-		}
+	float x, z;
+
+	if(getMapGenerator()->findSpawnPoint(&x, &z)) {
+		getObserver()->setPosition(-x, getObserver()->getPositionY(), -z);
 	}
 }
 
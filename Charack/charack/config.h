@@ -13,9 +13,78 @@
 #define CK_COAST_MAX_DIV				10
 #define CK_COAST_VARIATION				20
 
+// Size (pixels of the macro map) of the cells of the index of the coast segments
+#define CK_COAST_INDEX_CELL				8
+
 // Max world width/height
 #define CK_MAX_WIDTH					3000000.0
 
+// How many threads CharackMapGenerator will use to generate the macro map (0 means one thread per core)
+#define CK_MAP_THREADS					0
+
+// How many rows of the macro map each thread will generate at once
+#define CK_MAP_BAND_ROWS				8
+
+// Subdivision node cache of the macro map: levels between cached depths and nodes kept per depth
+#define CK_NODE_CACHE_STEP				4
+#define CK_NODE_CACHE_WAYS				1
+
+// If the macro map is generated with the scanline coherent descent (1) or with the node cache (0)
+#define CK_MAP_COHERENT					1
+
+// If the macro map only keeps the land/water information (1), which lets the subdivision stop early, or the altitude colours (0)
+#define CK_MAP_LAND_MASK_ONLY			1
+
+// How many points CharackMapGenerator::planetBatch() evaluates together (at most 32)
+#define CK_MAP_BATCH					8
+
+// Each thread generating the macro map remembers the last 2^CK_EDGE_TABLE_BITS edge midpoints (80 bytes each), 0 to disable
+#define CK_EDGE_TABLE_BITS				12
+
+// Alignment (bytes) of the macro map and of each one of its rows
+#define CK_MAP_ALIGN					64
+
+// Directory where the generated macro maps are cached ("" to disable the cache), the max length of its path,
+// and the tag and version of the cache files (a file of another version is generated again)
+#define CK_MAP_CACHE_DIR				""
+#define CK_CACHE_PATH_MAX				256
+#define CK_CACHE_MAGIC					"CKMAP\0\0\0"
+#define CK_CACHE_VERSION				5
+
+// Formats of CharackMapGenerator::exportMap() and the size of the buffer of the file being written (bytes)
+#define CK_EXPORT_BMP_BW				0
+#define CK_EXPORT_BMP					1
+#define CK_EXPORT_PPM					2
+#define CK_EXPORT_BUFFER				65536
+
+// Layout of the land mask of the macro map (see CharackMapGenerator::setMaskLayout())
+#define CK_MASK_ROWS					0
+#define CK_MASK_COLUMNS					1
+#define CK_MASK_MORTON					2
+#define CK_MAP_MASK_LAYOUT				CK_MASK_ROWS
+
+// How many observer positions CharackMapGenerator::benchmarkMaskLayouts() tests
+#define CK_BENCHMARK_POSITIONS			8
+
+// Land pyramid of the macro map: maximum number of levels and the value of a cell of the lazy map that was not generated yet
+#define CK_PYRAMID_MAX_LEVELS			30
+#define CK_PYRAMID_UNKNOWN				255
+
+// If the macro map is generated tile by tile when it is used (1) or all at once by generate() (0), and the size of the tiles (pixels)
+#define CK_MAP_LAZY						1
+#define CK_MAP_TILE_SIZE				64
+
+// If the macro map keeps the altitude of every pixel (1) or only its colour (0)
+#define CK_MAP_KEEP_ALTITUDE			0
+
+// How the outline of the macro map is found (see CharackMapGenerator::setOutline())
+#define CK_OUTLINE_BITS					0
+#define CK_OUTLINE_BYTES				1
+#define CK_MAP_OUTLINE					CK_OUTLINE_BITS
+
+// How much the keys of main.cpp move the sea level of the macro map
+#define CK_MACRO_SEA_LEVEL_STEP			0.005
+
 // Useful macros
 #define CK_DEG2RAD(X)					((PI*(X))/180)
 
@@ -32,6 +32,17 @@ void sanitizePosition() {
 	}
 }
 
+// Move the sea level of the macro map. The first change keeps the altitudes of the map (generating it again), so the
+// next ones only have to threshold them again.
+void changeMacroSeaLevel(double theStep) {
+	CharackMapGenerator *aMap = gWorld.getMapGenerator();
+
+	if(!aMap->setMacroSeaLevel(aMap->getMacroSeaLevel() + theStep)) {
+		aMap->setKeepAltitude(1);
+		aMap->generate();
+	}
+}
+
 void processNormalKeys(unsigned char key, int x, int y) {
 	switch(key) {
 		case 27:
@@ -123,6 +134,25 @@ void processNormalKeys(unsigned char key, int x, int y) {
 			gSeaLevel += 1;
 			break;
 
+		case 'h':
+			// Decrease the sea level of the macro map (land and water)
+			changeMacroSeaLevel(-CK_MACRO_SEA_LEVEL_STEP);
+			break;
+		case 'j':
+			// Increase the sea level of the macro map (land and water)
+			changeMacroSeaLevel(CK_MACRO_SEA_LEVEL_STEP);
+			break;
+
+		case 'b':
+			// Compare the layouts of the land mask of the macro map
+			gWorld.getMapGenerator()->benchmarkMaskLayouts(gWorld.getViewFrustum());
+			break;
+
+		case 'o':
+			// Save the macro map (in the background)
+			gWorld.getMapGenerator()->exportMap("charack-map.bmp", CK_EXPORT_BMP);
+			break;
+
 		case 'p':
 			// Toggle controller for global viewing (view from top).
 			if(gWorld.getObserver()->getRotationX() == 90) {